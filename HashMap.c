@@ -1,101 +1,967 @@
 #include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "HashMap.h"
+#include "epoch.h"
+
+// Slots are probed in aligned groups of GROUP_SIZE, matched all at once.
+#define GROUP_SIZE 16
+
+// Capacity of a new map, and the smallest capacity a map shrinks back to.
+// Capacities are always powers of two, and multiples of GROUP_SIZE.
+#define MIN_CAPACITY GROUP_SIZE
+
+// At most MAX_LOAD_NUM / MAX_LOAD_DEN of the slots can be taken (counting tombstones).
+// The table shrinks once less than 1 / SHRINK_DEN of them hold entries.
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
+#define SHRINK_DEN 8
+
+// Control bytes, one per slot. A full slot stores the 7-bit fingerprint of its key
+// (so the high bit is clear), the special values have the high bit set.
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
 
-// We fix the number of hash buckets for simplicity.
-#define N_BUCKETS 8
+// Entries of a large table are also linked into a skiplist sorted by key, so that they
+// can be visited in order without sorting. An entry takes part in the lowest
+// `level` lists, a level being drawn from its hash: P(level > k) = 4^-k.
+#define MAX_LEVEL 16
 
-typedef struct Pair Pair;
+// Tables of up to SORTED_MAX_CAPACITY slots keep their entries in a sorted array instead.
+// At that size shifting the array costs less than updating the skiplist, and the entries
+// need no links. Since a table doubles at 7/8 load and halves below 1/8, a map switches
+// to the skiplist at about 900 entries, and back only below 256.
+#define SORTED_MAX_CAPACITY 1024
 
-struct Pair {
-    char* key;
+// Keys of up to PACKED_MAX_LENGTH letters 'a'-'z' (most folder names) are also packed into
+// an integer, 5 bits per letter, first letter highest, so that comparing packed keys as
+// integers orders them like strcmp. The hash of a packed key is a bijection of the packed key
+// with PACKED_HASH_BIT set, while other keys have it clear, so packed keys are equal exactly
+// when their hashes are. That bit is above the bits `entry_level` looks at.
+#define PACKED_MAX_LENGTH 12
+#define PACKED_HASH_BIT (1ull << 31)
+
+typedef struct HashMapEntry Entry;
+
+// An entry is a single allocation holding the value, the skiplist links and a copy of the key.
+struct HashMapEntry {
     void* value;
-    Pair* next; // Next item in a single-linked list.
+    uint64_t packed; // The key packed, or 0 if it is too long or not made of letters.
+    uint32_t length; // Length of the key.
+    uint32_t level; // Number of skiplist links, 0 unless the map `is_ordered`.
+    Entry* next[]; // `level` links, followed by the key (see `entry_key`).
 };
 
-struct HashMap {
-    Pair* buckets[N_BUCKETS]; // Linked lists of key-value pairs.
-    size_t size; // total number of entries in map.
+typedef struct HashMapSlot Slot;
+
+typedef struct HashMapSlab Slab;
+
+typedef struct HashMapTable Table;
+
+// Up to SMALL_CAPACITY entries are kept inline in the map itself, so that small
+// maps (most directories) never allocate a table. So a map has one of three kinds:
+// inline entries, a table with a sorted array, and a table with a skiplist.
+#define SMALL_CAPACITY HMAP_SMALL_CAPACITY
+
+// A SwissTable-style open-addressing table: `ctrl[i]` describes `slots[i]`.
+// Lookups compare the fingerprint of a key with a whole group of control bytes
+// at once, and only compare keys in slots whose fingerprint and full hash matched.
+// A lookup stops at the first group containing an empty slot.
+// The map itself (struct HashMap) is laid out in HashMap.h, so that it can be embedded.
+//
+// Lookups may run concurrently with changes (see `hmap_get`). A table is never resized in
+// place: a fresh one is built and published, and the old one is retired (see epoch.h),
+// and so are removed entries and slabs no table uses anymore. Entries never change once
+// published, and a slot is published by its control byte, after the slot itself.
+struct HashMapTable {
+    size_t capacity; // Number of slots.
+    Slot* slots;
+    Entry** head; // First entry of each skiplist level, or NULL.
+    Entry** sorted; // All entries sorted by key, or NULL.
+    size_t top_level; // Number of non-empty skiplist levels.
+    size_t growth_left; // Number of empty slots that can still be filled before a rehash.
+    Slab* slab; // Memory of the entries.
+    // `capacity` control bytes, followed in the same allocation by the slots
+    // and then the skiplist heads or the sorted array.
+    uint8_t ctrl[];
 };
 
-static unsigned int get_hash(const char* key);
+static uint64_t new_seed(void);
+
+static uint8_t fingerprint(uint64_t hash)
+{
+    return hash >> 57;
+}
+
+static bool is_full(uint8_t ctrl)
+{
+    return !(ctrl & 0x80);
+}
+
+// A bitmask with bit i set iff control byte i of the group satisfies some condition.
+typedef unsigned int GroupMask;
+
+#ifdef __SSE2__
+static GroupMask group_match(const uint8_t* group, uint8_t byte)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+}
+
+// Mask of the slots that are empty or deleted, i.e. whose control byte has the high bit set.
+static GroupMask group_match_free(const uint8_t* group)
+{
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#else
+static GroupMask group_match(const uint8_t* group, uint8_t byte)
+{
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; ++i)
+        mask |= (GroupMask)(group[i] == byte) << i;
+    return mask;
+}
+
+static GroupMask group_match_free(const uint8_t* group)
+{
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; ++i)
+        mask |= (GroupMask)(group[i] >> 7) << i;
+    return mask;
+}
+#endif
+
+// Return the lowest set bit index of a non-zero mask, and clear it.
+static int mask_pop(GroupMask* mask)
+{
+    int i = __builtin_ctz(*mask);
+    *mask &= *mask - 1;
+    return i;
+}
+
+// Groups are visited in triangular order: g, g + 1, g + 3, g + 6, ...
+// Since the number of groups is a power of two, this visits all of them.
+typedef struct ProbeSeq {
+    size_t group;
+    size_t step;
+    size_t mask;
+} ProbeSeq;
+
+static ProbeSeq probe_start(Table* table, uint64_t hash)
+{
+    size_t n_groups = table->capacity / GROUP_SIZE;
+    ProbeSeq seq = { (size_t)(hash >> 32) & (n_groups - 1), 0, n_groups - 1 };
+    return seq;
+}
+
+static void probe_next(ProbeSeq* seq)
+{
+    seq->step++;
+    seq->group = (seq->group + seq->step) & seq->mask;
+}
+
+static size_t max_load(size_t capacity)
+{
+    return capacity / MAX_LOAD_DEN * MAX_LOAD_NUM;
+}
+
+static bool is_small(HashMap* map)
+{
+    return map->table == NULL;
+}
+
+// Return whether the entries of a table with `capacity` slots are linked into a skiplist.
+static bool is_ordered_capacity(size_t capacity)
+{
+    return capacity > SORTED_MAX_CAPACITY;
+}
+
+// Return whether the entries of the map are linked into a skiplist (large tables only).
+static bool is_ordered(HashMap* map)
+{
+    return map->table && is_ordered_capacity(map->table->capacity);
+}
+
+// Return the size in bytes of the allocation of a table with `capacity` slots.
+static size_t table_size(size_t capacity)
+{
+    size_t n_order = is_ordered_capacity(capacity) ? MAX_LEVEL : max_load(capacity);
+    return sizeof(Table) + capacity * (1 + sizeof(Slot)) + n_order * sizeof(Entry*);
+}
+
+static char* entry_key(Entry* entry)
+{
+    return (char*)&entry->next[entry->level];
+}
+
+static uint32_t entry_level(uint64_t hash)
+{
+    // The group index and the fingerprint use the high bits, this uses the low ones.
+    uint32_t bits = (uint32_t)hash | (1u << (2 * (MAX_LEVEL - 1)));
+    return 1 + __builtin_ctz(bits) / 2;
+}
+
+// The entries of a table are carved out of chunks owned by its slab instead of being malloc'ed
+// one by one: they lie close together, inserting rarely calls malloc, and they are released
+// all at once. A slab only ever hands out new memory, so that a removed entry stays intact
+// for concurrent lookups until the whole slab is retired. Instead of reusing it, once the
+// slab has become sparse (see SLAB_SPARSE), or when the entries change layout, they are copied
+// into a fresh slab, and the old one is retired.
+// Inline entries are malloc'ed, so that small maps do not pay for a slab. They move
+// to the slab when the map gets a table, and back when it goes inline again.
+// Like the rest of the map, a slab is only touched by whoever may modify the map.
+
+// Entry sizes are rounded up to multiples of SLAB_GRAIN. Entries larger than
+// SLAB_MAX_ENTRY bytes (keys of hundreds of bytes) are malloc'ed directly.
+#define SLAB_GRAIN 16
+#define SLAB_MAX_ENTRY 512
+
+// The first chunk is allocated together with the slab itself. Each next chunk is twice
+// as large as the previous one, up to SLAB_MAX_CHUNK bytes.
+#define SLAB_FIRST_CHUNK 512
+#define SLAB_MAX_CHUNK (64 << 10)
+
+// A slab is sparse once it takes more than SLAB_SPARSE times the memory of its live entries
+// (and of an empty slab). Copying the entries of a sparse slab into a fresh one frees at least
+// half of its memory, so every entry copied was paid for by a removal.
+#define SLAB_SPARSE 4
+
+typedef struct Chunk Chunk;
+
+struct Chunk {
+    Chunk* prev;
+    char data[];
+};
+
+struct HashMapSlab {
+    Chunk* chunks; // Chunks allocated after the first one, newest first.
+    char* top; // Unused space of the newest chunk is top .. end - 1.
+    char* end;
+    size_t chunk_size; // Size of the newest chunk.
+    size_t n_large; // Number of live entries that were malloc'ed directly.
+    size_t bytes; // Memory currently allocated by the slab, including itself.
+    size_t live; // Memory of the live entries, in rounded sizes.
+    char first[SLAB_FIRST_CHUNK];
+};
+
+static size_t entry_size(uint32_t level, size_t length)
+{
+    return sizeof(Entry) + level * sizeof(Entry*) + length + 1;
+}
+
+static bool slab_is_large(size_t size)
+{
+    return size > SLAB_MAX_ENTRY;
+}
+
+// Round `size` up to a multiple of SLAB_GRAIN.
+static size_t slab_round(size_t size)
+{
+    return (size + SLAB_GRAIN - 1) / SLAB_GRAIN * SLAB_GRAIN;
+}
+
+static Slab* slab_new(void)
+{
+    Slab* slab = malloc(sizeof(Slab));
+    if (!slab)
+        return NULL;
+    slab->chunks = NULL;
+    slab->top = slab->first;
+    slab->end = slab->first + SLAB_FIRST_CHUNK;
+    slab->chunk_size = SLAB_FIRST_CHUNK;
+    slab->n_large = 0;
+    slab->bytes = sizeof(Slab);
+    slab->live = 0;
+    return slab;
+}
+
+// Make sure that the next `size` bytes (of rounded sizes) can be allocated without
+// calling malloc. Returns false on allocation failure.
+static bool slab_reserve(Slab* slab, size_t size)
+{
+    if ((size_t)(slab->end - slab->top) >= size)
+        return true;
+    // The rest of the old chunk is dropped, it is usually smaller than an entry.
+    size_t chunk_size = slab->chunk_size < SLAB_MAX_CHUNK ? slab->chunk_size * 2 : SLAB_MAX_CHUNK;
+    if (chunk_size < size)
+        chunk_size = size;
+    Chunk* chunk = malloc(sizeof(Chunk) + chunk_size);
+    if (!chunk)
+        return false;
+    chunk->prev = slab->chunks;
+    slab->chunks = chunk;
+    slab->bytes += sizeof(Chunk) + chunk_size;
+    slab->top = chunk->data;
+    slab->end = chunk->data + chunk_size;
+    slab->chunk_size = chunk_size;
+    return true;
+}
+
+// Return `size` bytes for an entry, or NULL on allocation failure.
+static void* slab_alloc(Slab* slab, size_t size)
+{
+    if (slab_is_large(size)) {
+        void* result = malloc(size);
+        if (result) {
+            slab->n_large++;
+            slab->bytes += size;
+            slab->live += size;
+        }
+        return result;
+    }
+
+    size = slab_round(size);
+    if (!slab_reserve(slab, size))
+        return NULL;
+    void* result = slab->top;
+    slab->top += size;
+    slab->live += size;
+    return result;
+}
+
+// Account for an entry of `size` bytes returned by `slab_alloc` being given back.
+// Large entries are then freed (or retired) by the caller, small ones only with the slab.
+static void slab_free(Slab* slab, size_t size)
+{
+    if (slab_is_large(size)) {
+        slab->n_large--;
+        slab->bytes -= size;
+        slab->live -= size;
+        return;
+    }
+    slab->live -= slab_round(size);
+}
+
+// Return whether the slab takes much more memory than its entries, see SLAB_SPARSE.
+static bool slab_is_sparse(Slab* slab)
+{
+    return slab->bytes > SLAB_SPARSE * (slab->live + sizeof(Slab));
+}
+
+// Release the memory of all entries at once. Entries malloc'ed directly must have been
+// freed (or handed over to someone else) before.
+static void slab_release(Slab* slab)
+{
+    assert(slab->n_large == 0);
+    while (slab->chunks) {
+        Chunk* prev = slab->chunks->prev;
+        free(slab->chunks);
+        slab->chunks = prev;
+    }
+    free(slab);
+}
+
+// Release a slab retired by `hmap_resize`.
+static void retired_slab_release(void* slab)
+{
+    slab_release(slab);
+}
+
+// Return `key` of the given length packed, or 0 if it cannot be.
+static uint64_t pack(const char* key, size_t length)
+{
+    if (length == 0 || length > PACKED_MAX_LENGTH)
+        return 0;
+    uint64_t packed = 0;
+    for (size_t i = 0; i < PACKED_MAX_LENGTH; ++i) {
+        unsigned int letter = 0; // Positions past the end count as 0, below any letter.
+        if (i < length) {
+            letter = (unsigned char)key[i] - 'a' + 1;
+            if (letter - 1 >= 26)
+                return 0;
+        }
+        packed = packed << 5 | letter;
+    }
+    return packed;
+}
+
+// Return the hash of `key`, whose packed form is `packed`, see PACKED_HASH_BIT.
+static uint64_t key_hash(HashMap* map, const char* key, size_t length, uint64_t packed)
+{
+    if (!packed)
+        return hmap_hash(key, length, map->seed) & ~PACKED_HASH_BIT;
+    // Xoring, multiplying by an odd number and xor-shifting are all invertible modulo 2^63.
+    // Two rounds are needed: a product's bits only depend on the factor's lower bits, and
+    // short keys have all their letters in the high bits. The resulting 63 bits are spread
+    // around PACKED_HASH_BIT.
+    const uint64_t low63 = (1ull << 63) - 1;
+    uint64_t h = (packed ^ map->seed) & low63;
+    h ^= h >> 31;
+    h = (h * 0x9e3779b97f4a7c15ull) & low63;
+    h ^= h >> 30;
+    h = (h * 0xbf58476d1ce4e5b9ull) & low63;
+    h ^= h >> 32;
+    return (h >> 31) << 32 | PACKED_HASH_BIT | (h & (PACKED_HASH_BIT - 1));
+}
+
+static Entry* entry_new(HashMap* map, const char* key, size_t length, uint64_t packed, uint64_t hash, void* value)
+{
+    uint32_t level = is_ordered(map) ? entry_level(hash) : 0;
+    size_t size = entry_size(level, length);
+    Entry* entry = is_small(map) ? malloc(size) : slab_alloc(map->table->slab, size);
+    if (!entry)
+        return NULL;
+    entry->value = value;
+    entry->packed = packed;
+    entry->length = length;
+    entry->level = level;
+    memcpy(entry_key(entry), key, length);
+    entry_key(entry)[length] = '\0';
+    return entry;
+}
+
+// Free an entry that lookups cannot be looking at, allocated from `slab`,
+// or by malloc if `slab` is NULL.
+static void entry_free(Entry* entry, Slab* slab)
+{
+    size_t size = entry_size(entry->level, entry->length);
+    if (slab)
+        slab_free(slab, size);
+    if (!slab || slab_is_large(size))
+        free(entry);
+}
+
+// Like `entry_free`, for a removed entry that lookups may still be looking at.
+static void entry_retire(Entry* entry, Slab* slab)
+{
+    size_t size = entry_size(entry->level, entry->length);
+    if (slab)
+        slab_free(slab, size);
+    if (!slab || slab_is_large(size))
+        epoch_retire(entry, free);
+}
+
+// Compare the keys of two entries, like strcmp.
+static int entry_compare(Entry* a, Entry* b)
+{
+    if (a->packed && b->packed)
+        return (a->packed > b->packed) - (a->packed < b->packed);
+    int result = memcmp(entry_key(a), entry_key(b), a->length < b->length ? a->length : b->length);
+    if (result)
+        return result;
+    return (a->length > b->length) - (a->length < b->length);
+}
 
 HashMap* hmap_new()
 {
     HashMap* map = malloc(sizeof(HashMap));
     if (!map)
         return NULL;
-    memset(map, 0, sizeof(HashMap));
+    hmap_init(map);
     return map;
 }
 
+void hmap_init(HashMap* map)
+{
+    map->seed = new_seed();
+    map->size = 0;
+    map->table = NULL;
+}
+
+// Entries are visited by scanning positions 0 .. n_positions(map) - 1, see `entry_at`.
+static size_t n_positions(HashMap* map)
+{
+    return is_small(map) ? map->size : map->table->capacity;
+}
+
+// Return the entry at position i, or NULL if that table slot is free.
+static Slot* entry_at(HashMap* map, size_t i)
+{
+    if (is_small(map))
+        return &map->small[i];
+    return is_full(map->table->ctrl[i]) ? &map->table->slots[i] : NULL;
+}
+
 void hmap_free(HashMap* map)
 {
-    for (int h = 0; h < N_BUCKETS; ++h) {
-        for (Pair* p = map->buckets[h]; p;) {
-            Pair* q = p;
-            p = p->next;
-            free(q->key);
-            free(q);
+    hmap_destroy(map);
+    free(map);
+}
+
+void hmap_destroy(HashMap* map)
+{
+    Slab* slab = is_small(map) ? NULL : map->table->slab;
+    if (!slab || slab->n_large) {
+        for (size_t i = 0; i < n_positions(map); ++i) {
+            Slot* slot = entry_at(map, i);
+            if (slot && (!slab || slab_is_large(entry_size(slot->entry->level, slot->entry->length))))
+                entry_free(slot->entry, slab);
         }
     }
-    free(map);
+    if (slab) {
+        slab_release(slab);
+        free(map->table);
+    }
 }
 
-static Pair* hmap_find(HashMap* map, int h, const char* key)
+// Store `slot` into `*target`, where concurrent lookups may read it.
+static void slot_store(Slot* target, Slot slot)
 {
-    for (Pair* p = map->buckets[h]; p; p = p->next) {
-        if (strcmp(key, p->key) == 0)
-            return p;
+    __atomic_store_n(&target->hash, slot.hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&target->entry, slot.entry, __ATOMIC_RELAXED);
+}
+
+static bool slot_matches(const Slot* slot, const char* key, size_t length, uint64_t hash)
+{
+    // The slot may change meanwhile, but its entry is one that was stored there, and
+    // entries never change: all that can go wrong is a wrong result, see `hmap_get`.
+    if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash)
+        return false;
+    if (hash & PACKED_HASH_BIT)
+        return true; // No need to look at the entry.
+    Entry* entry = __atomic_load_n(&slot->entry, __ATOMIC_RELAXED);
+    return entry->length == length && memcmp(entry_key(entry), key, length) == 0;
+}
+
+// Return the slot holding `key` of the given length, or NULL if it is not present.
+static Slot* hmap_find(HashMap* map, const char* key, size_t length, uint64_t hash)
+{
+    Table* table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    if (!table) {
+        // The size may be newer than the inline entries, but never larger than them.
+        size_t size = __atomic_load_n(&map->size, __ATOMIC_ACQUIRE);
+        for (size_t i = 0; i < size && i < SMALL_CAPACITY; ++i) {
+            if (slot_matches(&map->small[i], key, length, hash))
+                return &map->small[i];
+        }
+        return NULL;
+    }
+
+    // Slots change while a concurrent lookup probes them, so it may never see an empty one:
+    // it stops after visiting every group once.
+    uint8_t fp = fingerprint(hash);
+    ProbeSeq seq = probe_start(table, hash);
+    for (size_t n = 0; n <= seq.mask; ++n, probe_next(&seq)) {
+        const uint8_t* group = table->ctrl + seq.group * GROUP_SIZE;
+        GroupMask match = group_match(group, fp);
+        // Slots are read after the control bytes that published them.
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        while (match) {
+            Slot* slot = &table->slots[seq.group * GROUP_SIZE + mask_pop(&match)];
+            if (slot_matches(slot, key, length, hash))
+                return slot;
+        }
+        if (group_match(group, CTRL_EMPTY))
+            return NULL;
     }
     return NULL;
 }
 
-void* hmap_get(HashMap* map, const char* key)
+// Return the index of the first empty or deleted slot of the table on the probe sequence of `hash`.
+static size_t hmap_find_free(Table* table, uint64_t hash)
 {
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
-    if (p)
-        return p->value;
-    else
+    for (ProbeSeq seq = probe_start(table, hash);; probe_next(&seq)) {
+        GroupMask free_mask = group_match_free(table->ctrl + seq.group * GROUP_SIZE);
+        if (free_mask)
+            return seq.group * GROUP_SIZE + __builtin_ctz(free_mask);
+    }
+}
+
+// Fill the free slot i of the table, and then publish it to lookups.
+static void slot_publish(Table* table, size_t i, Slot slot)
+{
+    slot_store(&table->slots[i], slot);
+    __atomic_store_n(&table->ctrl[i], fingerprint(slot.hash), __ATOMIC_RELEASE);
+}
+
+// Return the link at `level` following `entry`, where a NULL entry stands for the head.
+static Entry** next_link(Table* table, Entry* entry, size_t level)
+{
+    return entry ? &entry->next[level] : &table->head[level];
+}
+
+// Set `preds[l]` to the last entry before `entry` at each level l (NULL for the head).
+static void skiplist_find_preds(Table* table, Entry* entry, Entry** preds)
+{
+    Entry* pred = NULL;
+    for (size_t l = table->top_level; l-- > 0;) {
+        Entry* next;
+        while ((next = *next_link(table, pred, l)) && entry_compare(next, entry) < 0)
+            pred = next;
+        preds[l] = pred;
+    }
+}
+
+static void skiplist_insert(Table* table, Entry* entry)
+{
+    Entry* preds[MAX_LEVEL];
+    skiplist_find_preds(table, entry, preds);
+    for (; table->top_level < entry->level; table->top_level++)
+        preds[table->top_level] = NULL;
+    for (size_t l = 0; l < entry->level; ++l) {
+        Entry** link = next_link(table, preds[l], l);
+        entry->next[l] = *link;
+        *link = entry;
+    }
+}
+
+static void skiplist_remove(Table* table, Entry* entry)
+{
+    Entry* preds[MAX_LEVEL];
+    skiplist_find_preds(table, entry, preds);
+    for (size_t l = 0; l < entry->level; ++l)
+        *next_link(table, preds[l], l) = entry->next[l];
+    while (table->top_level > 0 && !table->head[table->top_level - 1])
+        table->top_level--;
+}
+
+// Return the index of the first of the `n` entries of the sorted array not less than `entry`.
+static size_t sorted_lower_bound(Table* table, size_t n, Entry* entry)
+{
+    size_t low = 0, high = n;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (entry_compare(table->sorted[middle], entry) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+// Insert `entry` into the sorted array of `n` entries.
+static void sorted_insert(Table* table, size_t n, Entry* entry)
+{
+    size_t i = sorted_lower_bound(table, n, entry);
+    memmove(table->sorted + i + 1, table->sorted + i, (n - i) * sizeof(Entry*));
+    table->sorted[i] = entry;
+}
+
+// Remove `entry` from the sorted array of `n` entries.
+static void sorted_remove(Table* table, size_t n, Entry* entry)
+{
+    size_t i = sorted_lower_bound(table, n, entry);
+    assert(table->sorted[i] == entry);
+    memmove(table->sorted + i, table->sorted + i + 1, (n - i - 1) * sizeof(Entry*));
+}
+
+// Insert `slot` into the sorted inline entries small[0 .. n - 1].
+static void small_insert(HashMap* map, size_t n, Slot slot)
+{
+    Entry* entry = slot.entry;
+    while (n > 0 && entry_compare(map->small[n - 1].entry, entry) > 0) {
+        slot_store(&map->small[n], map->small[n - 1]);
+        n--;
+    }
+    slot_store(&map->small[n], slot);
+}
+
+// Return a copy of `entry` with `level` (unset) links, allocated from `slab`,
+// or by malloc if `slab` is NULL. Returns NULL on allocation failure.
+static Entry* entry_copy(Entry* entry, Slab* slab, uint32_t level)
+{
+    size_t size = entry_size(level, entry->length);
+    Entry* copy = slab ? slab_alloc(slab, size) : malloc(size);
+    if (!copy)
         return NULL;
+    copy->value = entry->value;
+    copy->packed = entry->packed;
+    copy->length = entry->length;
+    copy->level = level;
+    memcpy(entry_key(copy), entry_key(entry), entry->length + 1);
+    return copy;
+}
+
+// Return the hash of the key of `entry` in `map`.
+static uint64_t entry_hash(HashMap* map, Entry* entry)
+{
+    return key_hash(map, entry_key(entry), entry->length, entry->packed);
+}
+
+// Link the `n` entries of `order`, sorted by key, into the empty skiplist.
+static void skiplist_build(Table* table, Entry** order, size_t n)
+{
+    // Each entry is appended to its lists.
+    Entry* last[MAX_LEVEL];
+    table->top_level = MAX_LEVEL;
+    for (size_t l = 0; l < MAX_LEVEL; ++l)
+        last[l] = NULL;
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t l = 0; l < order[i]->level; ++l) {
+            *next_link(table, last[l], l) = order[i];
+            last[l] = order[i];
+        }
+    }
+    for (size_t l = 0; l < MAX_LEVEL; ++l)
+        *next_link(table, last[l], l) = NULL;
+    while (table->top_level > 0 && !table->head[table->top_level - 1])
+        table->top_level--;
+}
+
+// Move all entries to a fresh table with `capacity` slots, dropping tombstones,
+// or back inline if `capacity` is 0 (then they must fit).
+// When the kind of the map changes (see `is_small` and `is_ordered`), the entries are
+// copied too, since where they are allocated and how many links they have depends on it.
+// Copies made for a table go to a fresh slab, and so do the entries of a table whose slab
+// is sparse, so that the old slab can be released.
+// The new table is built aside and then published, and what it replaces is retired.
+// On allocation failure the map is left unchanged.
+static bool hmap_resize(HashMap* map, size_t capacity)
+{
+    Table* old = map->table;
+    size_t old_capacity = old ? old->capacity : 0;
+    size_t n = map->size;
+    assert(capacity > 0 || n <= SMALL_CAPACITY);
+    bool moving = (old_capacity == 0) != (capacity == 0)
+        || is_ordered_capacity(old_capacity) != is_ordered_capacity(capacity);
+    bool fresh_slab = capacity > 0 && (moving || slab_is_sparse(old->slab));
+    bool copying = moving || fresh_slab;
+
+    // The entries in key order.
+    Entry* small_order[SMALL_CAPACITY];
+    Entry** order = small_order;
+    if (!old) {
+        for (size_t i = 0; i < n; ++i)
+            small_order[i] = map->small[i].entry;
+    } else if (!is_ordered_capacity(old_capacity)) {
+        order = old->sorted;
+    } else {
+        order = malloc(n * sizeof(Entry*) + 1);
+        if (!order)
+            return false;
+        size_t i = 0;
+        for (Entry* entry = old->head[0]; entry; entry = entry->next[0])
+            order[i++] = entry;
+    }
+
+    Table* table = NULL;
+    Slab* slab = NULL;
+    Entry* small_copies[SMALL_CAPACITY];
+    Entry** copies = small_copies;
+    size_t n_copies = 0;
+    if (copying && n > SMALL_CAPACITY) {
+        copies = malloc(n * sizeof(Entry*));
+        if (!copies)
+            goto fail;
+    }
+    if (capacity > 0) {
+        slab = fresh_slab ? slab_new() : old->slab;
+        table = slab ? malloc(table_size(capacity)) : NULL;
+        if (!table)
+            goto fail;
+        table->capacity = capacity;
+        table->slots = (Slot*)(table->ctrl + capacity);
+        table->head = is_ordered_capacity(capacity) ? (Entry**)(table->slots + capacity) : NULL;
+        table->sorted = is_ordered_capacity(capacity) ? NULL : (Entry**)(table->slots + capacity);
+        table->top_level = 0;
+        table->growth_left = max_load(capacity) - n;
+        table->slab = slab;
+        memset(table->ctrl, CTRL_EMPTY, capacity);
+    }
+
+    if (copying) {
+        // Reserve room for the copies, so that only large entries can fail to be copied.
+        size_t size = 0;
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t level = is_ordered_capacity(capacity) ? entry_level(entry_hash(map, order[i])) : 0;
+            size_t entry_bytes = entry_size(level, order[i]->length);
+            if (!slab_is_large(entry_bytes))
+                size += slab_round(entry_bytes);
+        }
+        if (slab && !slab_reserve(slab, size))
+            goto fail;
+        // The copies already go to their slots: the table is not published yet.
+        for (; n_copies < n; ++n_copies) {
+            uint64_t hash = entry_hash(map, order[n_copies]);
+            uint32_t level = is_ordered_capacity(capacity) ? entry_level(hash) : 0;
+            Entry* copy = entry_copy(order[n_copies], slab, level);
+            if (!copy)
+                goto fail;
+            copies[n_copies] = copy;
+            if (table)
+                slot_publish(table, hmap_find_free(table, hash), (Slot) { hash, copy });
+        }
+    }
+
+    // Nothing can fail from here on.
+    Entry** next_order = copying ? copies : order;
+    if (table) {
+        if (!copying) {
+            for (size_t i = 0; i < old_capacity; ++i) {
+                if (is_full(old->ctrl[i]))
+                    slot_publish(table, hmap_find_free(table, old->slots[i].hash), old->slots[i]);
+            }
+        }
+        if (!is_ordered_capacity(capacity)) {
+            memcpy(table->sorted, next_order, n * sizeof(Entry*));
+        } else if (copying) {
+            skiplist_build(table, next_order, n);
+        } else {
+            memcpy(table->head, old->head, MAX_LEVEL * sizeof(Entry*));
+            table->top_level = old->top_level;
+        }
+        __atomic_store_n(&map->table, table, __ATOMIC_RELEASE);
+    } else {
+        // The inline entries are written first: lookups that see no table read them,
+        // and some may have been reading them since before the map had a table.
+        for (size_t i = 0; i < n; ++i)
+            slot_store(&map->small[i], (Slot) { entry_hash(map, copies[i]), copies[i] });
+        __atomic_store_n(&map->table, NULL, __ATOMIC_RELEASE);
+    }
+
+    // What lookups may still be looking at is retired.
+    if (copying) {
+        for (size_t i = 0; i < n; ++i)
+            entry_retire(order[i], old ? old->slab : NULL);
+    }
+    if (order != small_order && order != old->sorted)
+        free(order);
+    if (copies != small_copies)
+        free(copies);
+    if (old) {
+        if (!slab || fresh_slab)
+            epoch_retire(old->slab, retired_slab_release);
+        epoch_retire(old, free);
+    }
+    return true;
+
+fail:
+    while (n_copies-- > 0)
+        entry_free(copies[n_copies], slab);
+    if (copies != small_copies)
+        free(copies);
+    free(table);
+    if (fresh_slab && slab)
+        slab_release(slab);
+    if (order != small_order && order != old->sorted)
+        free(order);
+    return false;
+}
+
+void* hmap_get(HashMap* map, const char* key)
+{
+    return hmap_get_n(map, key, strlen(key));
+}
+
+void* hmap_get_n(HashMap* map, const char* key, size_t length)
+{
+    Slot* slot = hmap_find(map, key, length, key_hash(map, key, length, pack(key, length)));
+    return slot ? __atomic_load_n(&slot->entry, __ATOMIC_RELAXED)->value : NULL;
+}
+
+// Set `*index` to a free slot of the table for a new entry with the given hash, making room
+// for it if needed. Returns false on allocation failure.
+static bool hmap_make_room(HashMap* map, uint64_t hash, size_t* index)
+{
+    size_t i = hmap_find_free(map->table, hash);
+    if (map->table->ctrl[i] == CTRL_EMPTY && map->table->growth_left == 0) {
+        // Grow if the table is really full, otherwise just clear the tombstones.
+        size_t capacity = map->table->capacity;
+        if ((map->size + 1) * 2 > max_load(capacity))
+            capacity *= 2;
+        if (!hmap_resize(map, capacity))
+            return false;
+        i = hmap_find_free(map->table, hash);
+    }
+    *index = i;
+    return true;
 }
 
 bool hmap_insert(HashMap* map, const char* key, void* value)
+{
+    return hmap_insert_n(map, key, strlen(key), value);
+}
+
+bool hmap_insert_n(HashMap* map, const char* key, size_t length, void* value)
 {
     if (!value)
         return false;
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
-    if (p)
+    uint64_t packed = pack(key, length);
+    uint64_t hash = key_hash(map, key, length, packed);
+    if (hmap_find(map, key, length, hash))
         return false; // Already exists.
-    Pair* new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
-    new_p->value = value;
-    new_p->next = map->buckets[h];
-    map->buckets[h] = new_p;
-    map->size++;
+
+    if (is_small(map) && map->size < SMALL_CAPACITY) {
+        Entry* entry = entry_new(map, key, length, packed, hash, value);
+        if (!entry)
+            return false;
+        small_insert(map, map->size, (Slot) { hash, entry });
+        __atomic_store_n(&map->size, map->size + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Make room first: the kind of the map decides how the entry is allocated.
+    // Removed entries take memory of the slab until it gets compacted, which a failure
+    // only puts off.
+    size_t i;
+    if (is_small(map) && !hmap_resize(map, MIN_CAPACITY))
+        return false;
+    if (slab_is_sparse(map->table->slab))
+        hmap_resize(map, map->table->capacity);
+    if (!hmap_make_room(map, hash, &i))
+        return false;
+    Entry* entry = entry_new(map, key, length, packed, hash, value);
+    if (!entry)
+        return false;
+
+    Table* table = map->table;
+    if (table->ctrl[i] == CTRL_EMPTY)
+        table->growth_left--;
+    slot_publish(table, i, (Slot) { hash, entry });
+    if (is_ordered(map))
+        skiplist_insert(table, entry);
+    else
+        sorted_insert(table, map->size, entry);
+    __atomic_store_n(&map->size, map->size + 1, __ATOMIC_RELEASE);
     return true;
 }
 
 bool hmap_remove(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair** pp = &(map->buckets[h]);
-    while (*pp) {
-        Pair* p = *pp;
-        if (strcmp(key, p->key) == 0) {
-            *pp = p->next;
-            free(p->key);
-            free(p);
-            map->size--;
-            return true;
-        }
-        pp = &(p->next);
+    return hmap_remove_n(map, key, strlen(key));
+}
+
+bool hmap_remove_n(HashMap* map, const char* key, size_t length)
+{
+    Slot* slot = hmap_find(map, key, length, key_hash(map, key, length, pack(key, length)));
+    if (!slot)
+        return false;
+    Entry* entry = slot->entry;
+
+    // The entry is retired only once lookups can no longer find it.
+    if (is_small(map)) {
+        for (Slot* last = map->small + map->size - 1; slot < last; ++slot)
+            slot_store(slot, slot[1]);
+        __atomic_store_n(&map->size, map->size - 1, __ATOMIC_RELEASE);
+        entry_retire(entry, NULL);
+        return true;
     }
-    return false;
+
+    Table* table = map->table;
+    if (is_ordered(map))
+        skiplist_remove(table, entry);
+    else
+        sorted_remove(table, map->size, entry);
+
+    // Lookups stop at the first group with an empty slot, so no probe sequence
+    // continues past a group that has one, and the slot can be emptied outright.
+    // Otherwise a tombstone keeps the sequences through this group intact.
+    size_t i = slot - table->slots;
+    if (group_match(table->ctrl + i / GROUP_SIZE * GROUP_SIZE, CTRL_EMPTY)) {
+        __atomic_store_n(&table->ctrl[i], CTRL_EMPTY, __ATOMIC_RELAXED);
+        table->growth_left++;
+    } else {
+        __atomic_store_n(&table->ctrl[i], CTRL_DELETED, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&map->size, map->size - 1, __ATOMIC_RELEASE);
+    entry_retire(entry, table->slab);
+
+    // Give memory back once the map gets sparse. A failed shrink only wastes space.
+    // Going back inline only at half the inline capacity avoids flapping at the boundary.
+    if (table->capacity == MIN_CAPACITY && map->size <= SMALL_CAPACITY / 2)
+        hmap_resize(map, 0);
+    else if (table->capacity > MIN_CAPACITY && map->size * SHRINK_DEN < table->capacity)
+        hmap_resize(map, table->capacity / 2);
+    return true;
 }
 
 size_t hmap_size(HashMap* map)
@@ -103,32 +969,100 @@ size_t hmap_size(HashMap* map)
     return map->size;
 }
 
+// Count a key whose lookup looks at `probe` groups.
+static void stats_add_probe(HashMapStats* stats, size_t probe)
+{
+    size_t bucket = probe < HMAP_PROBE_HISTOGRAM_SIZE ? probe : HMAP_PROBE_HISTOGRAM_SIZE;
+    stats->probe_histogram[bucket - 1]++;
+    if (probe > stats->max_probe)
+        stats->max_probe = probe;
+}
+
+HashMapStats hmap_stats(HashMap* map)
+{
+    HashMapStats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.size = map->size;
+    stats.bytes = sizeof(HashMap);
+
+    if (is_small(map)) {
+        // Inline entries are all looked at at once, like a single group.
+        stats.capacity = SMALL_CAPACITY;
+        for (size_t i = 0; i < map->size; ++i) {
+            Entry* entry = map->small[i].entry;
+            stats.bytes += entry_size(entry->level, entry->length);
+            stats_add_probe(&stats, 1);
+        }
+        return stats;
+    }
+
+    Table* table = map->table;
+    stats.capacity = table->capacity;
+    stats.bytes += table_size(table->capacity) + table->slab->bytes;
+    for (size_t i = 0; i < table->capacity; ++i) {
+        if (table->ctrl[i] == CTRL_DELETED)
+            stats.tombstones++;
+        if (!is_full(table->ctrl[i]))
+            continue;
+        size_t probe = 1;
+        for (ProbeSeq seq = probe_start(table, table->slots[i].hash); seq.group != i / GROUP_SIZE; probe_next(&seq))
+            probe++;
+        stats_add_probe(&stats, probe);
+    }
+    return stats;
+}
+
 HashMapIterator hmap_iterator(HashMap* map)
 {
-    HashMapIterator it = { 0, map->buckets[0] };
+    HashMapIterator it = { 0, is_ordered(map) ? map->table->head[0] : NULL };
     return it;
 }
 
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
 {
-    Pair* p = it->pair;
-    while (!p && it->bucket < N_BUCKETS - 1) {
-        p = map->buckets[++it->bucket];
+    Entry* entry;
+    if (!is_ordered(map)) {
+        if (it->slot == map->size)
+            return false;
+        entry = is_small(map) ? map->small[it->slot].entry : map->table->sorted[it->slot];
+        it->slot++;
+    } else {
+        if (!it->entry)
+            return false;
+        entry = it->entry;
+        it->entry = entry->next[0];
     }
-    if (!p)
-        return false;
-    *key = p->key;
-    *value = p->value;
-    it->pair = p->next;
+    *key = entry_key(entry);
+    *value = entry->value;
     return true;
 }
 
-static unsigned int get_hash(const char* key)
+// Return a fresh seed for a new map. Seeds derive from a process-wide random secret,
+// so that names colliding in one map (or one run) do not collide in another.
+// The secret hashes a number of the calling thread and a count of the maps it created,
+// which makes seeds distinct while new maps only touch memory of their own thread.
+static uint64_t new_seed(void)
 {
-    unsigned int hash = 17;
-    while (*key) {
-        hash = (hash << 3) + hash + *key;
-        ++key;
+    static atomic_uint_fast64_t secret = 0;
+    static atomic_uint_fast64_t n_threads = 0;
+    static _Thread_local uint64_t thread = 0, count = 0;
+
+    uint64_t s = atomic_load_explicit(&secret, memory_order_relaxed);
+    if (!s) {
+        if (getrandom(&s, sizeof(s), GRND_NONBLOCK) != sizeof(s)) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            uint64_t fallback[3] = { ts.tv_sec, ts.tv_nsec, (uintptr_t)&s };
+            s = hmap_hash((const char*)fallback, sizeof(fallback), 0);
+        }
+        s |= 1; // Never 0, which means "not initialized yet".
+        // If another thread won the race, use its secret, so that all maps share one.
+        uint_fast64_t expected = 0;
+        if (!atomic_compare_exchange_strong(&secret, &expected, s))
+            s = expected;
     }
-    return hash % N_BUCKETS;
+    if (!thread)
+        thread = atomic_fetch_add_explicit(&n_threads, 1, memory_order_relaxed) + 1;
+    uint64_t input[2] = { thread, count++ };
+    return hmap_hash((const char*)input, sizeof(input), s);
 }
@@ -1,9 +1,11 @@
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 // A structure representing a mapping from keys to values.
 // Keys are C-strings (null-terminated char*), all distinct.
+// (The trie implementation, Trie.c, only takes keys made of the letters 'a'-'z'.)
 // Values are non-null pointers (void*, which you can cast to any other pointer type).
 typedef struct HashMap HashMap;
 
@@ -14,29 +16,77 @@ HashMap* hmap_new();
 // copied by hmap_insert, but does not free any values.
 void hmap_free(HashMap* map);
 
+// Make `map` a new, empty map in memory that the caller owns, e.g. inside another structure.
+// This allocates nothing: an empty map, and in HashMap.c one with a few keys, needs no more
+// memory than `sizeof(HashMap)`.
+void hmap_init(HashMap* map);
+
+// Clear a map made by `hmap_init` and free the memory it allocated, like `hmap_free`,
+// except for `map` itself.
+void hmap_destroy(HashMap* map);
+
 // Get the value stored under `key`, or NULL if not present.
+//
+// Lookups (`hmap_get` and `hmap_get_n`) can also run concurrently with changes of the map,
+// inside an epoch critical section (see epoch.h): the map retires the memory it replaces
+// instead of freeing it, so a lookup never touches freed memory. Its result is meaningful
+// only if the caller then checks that the map didn't change meanwhile, e.g. with a version.
+// Everything else needs exclusive access to the map.
 void* hmap_get(HashMap* map, const char* key);
 
+// Like `hmap_get`, but the key is the `length` bytes at `key`, which need not be null-terminated
+// (e.g. a component inside a path). The bytes themselves must not contain '\0'.
+// The same holds for `hmap_insert_n` and `hmap_remove_n`.
+void* hmap_get_n(HashMap* map, const char* key, size_t length);
+
 // Insert a `value` under `key` and return true,
 // or do nothing and return false if `key` already exists in the map.
 // `value` must not be NULL.
 // (The caller can free `key` at any time - the map internally uses a copy of it).
 bool hmap_insert(HashMap* map, const char* key, void* value);
+bool hmap_insert_n(HashMap* map, const char* key, size_t length, void* value);
 
 // Remove the value under `key` and return true (the value is not free'd),
 // or do nothing and return false if `key` was not present.
 bool hmap_remove(HashMap* map, const char* key);
+bool hmap_remove_n(HashMap* map, const char* key, size_t length);
 
 // Return the number of elements in the map.
 size_t hmap_size(HashMap* map);
 
+// Return the hash of the `length` bytes at `key` under `seed`, which should be random.
+// This is the hash function maps use internally, each map with its own random seed,
+// so that which names collide cannot be predicted. Exposed for benchmarks.
+uint64_t hmap_hash(const char* key, size_t length, uint64_t seed);
+
+// Number of buckets of the probe length histogram of `HashMapStats`.
+#define HMAP_PROBE_HISTOGRAM_SIZE 16
+
+typedef struct HashMapStats HashMapStats;
+
+// Statistics about a map, see `hmap_stats`.
+struct HashMapStats {
+    size_t size; // Number of keys.
+    size_t capacity; // Number of places for keys: table slots, inline slots or trie nodes.
+    size_t tombstones; // Number of table slots of removed keys not yet reused.
+    size_t bytes; // Memory used by the map, including the copies of keys.
+    // probe_histogram[i] is the number of keys a lookup finds after looking at i + 1 groups
+    // of slots (or trie nodes). The last bucket also counts longer lookups.
+    size_t probe_histogram[HMAP_PROBE_HISTOGRAM_SIZE];
+    size_t max_probe; // Longest lookup of a key present in the map.
+};
+
+// Return statistics about the map. This takes time linear in its capacity.
+HashMapStats hmap_stats(HashMap* map);
+
 typedef struct HashMapIterator HashMapIterator;
 
 // Return an iterator to the map. See `hmap_next`.
 HashMapIterator hmap_iterator(HashMap* map);
 
 // Set `*key` and `*value` to the current element pointed by iterator and
-// move the iterator to the next element.
+// move the iterator to the next element. Elements are visited in increasing
+// order of keys (as compared by strcmp).
 // If there are no more elements, leaves `*key` and `*value` unchanged and
 // returns false.
 //
@@ -52,6 +102,32 @@ HashMapIterator hmap_iterator(HashMap* map);
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value);
 
 struct HashMapIterator {
-    int bucket;
-    void* pair;
+    size_t slot;
+    void* entry;
+};
+
+// The layout of a map is public only so that maps can be embedded (see `hmap_init`),
+// its fields are private to the implementation chosen by HASHMAP_TRIE.
+#ifdef HASHMAP_TRIE
+struct HashMap {
+    struct HashMapNode* root; // Node of the empty prefix, or NULL while the map is empty.
+    size_t size;
+};
+#else
+// Number of entries kept inline, see HashMap.c.
+#define HMAP_SMALL_CAPACITY 4
+
+struct HashMapSlot {
+    uint64_t hash; // Full hash of the key, so that mismatches and rehashing skip the string.
+    struct HashMapEntry* entry;
+};
+
+struct HashMap {
+    uint64_t seed; // Random seed of the hash function.
+    size_t size; // Number of entries.
+    struct HashMapTable* table; // The table, or NULL while the entries are kept inline.
+    // Inline entries, sorted by key. They don't share memory with the table, so that
+    // a concurrent lookup (see `hmap_get`) never takes one for the other.
+    struct HashMapSlot small[HMAP_SMALL_CAPACITY];
 };
+#endif
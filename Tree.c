@@ -1,42 +1,104 @@
 #include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include "Tree.h"
 #include "HashMap.h"
 #include "path_utils.h"
 #include "err.h"
+#include "epoch.h"
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h> // strlen, strcmp
 
-struct Tree {
-    /* map of children of this tree */
-    HashMap* map; 
+/* number of maps the children of a striped node are spread over */
+#define N_STRIPES 16
+
+/* a node gets striped once it has that many children */
+#define STRIPE_THRESHOLD 64
+
+/* a striped node gets unstriped once it has fewer children than that */
+#define UNSTRIPE_THRESHOLD (STRIPE_THRESHOLD / 4)
+
+/* number of counters of the root's read indicator */
+#define N_READ_SLOTS 64
+
+/* size of a cache line, so that the counters of the read indicator don't share them */
+#define CACHE_LINE 64
 
-    /* mutex that protects Tree's variables */
+/* a counter of the root's read indicator */
+typedef struct ReadSlot {
+    _Alignas(CACHE_LINE) size_t count;
+} ReadSlot;
+
+/* one of the maps of a striped node, together with the mutex that protects it */
+typedef struct Stripe {
     pthread_mutex_t mutex;
+    HashMap map;
+
+    /* version of map, see version_begin */
+    size_t version;
+} Stripe;
+
+struct Tree {
+    /* map of children of this tree, empty if the tree is striped. it is part of the node,
+       so that creating a folder allocates just the node */
+    HashMap map;
+
+    /* N_STRIPES maps that hold the children instead of map, or NULL if the tree isn't striped */
+    Stripe* stripes;
 
-    /* condition variables on which processes wait to read, write espectively */
-    pthread_cond_t read_cond, write_cond;
+    /* version of map and of the switch to stripes, see version_begin */
+    size_t version;
 
-    /* number of processes waiting to read and write, respectively */
-    size_t read_wait, write_wait;
+    /* the node's reader-writer lock in a single word, see the LOCK_ bits */
+    uint64_t lock;
 
-    /* number of processes reading and writing, respectively */
-    size_t read_count, write_count;
+    /* estimated number of spins a wait for the lock takes, see spin_update */
+    uint32_t spin;
 
-    /* number of processes that work in this Tree's subtree (this tree including) */
-    size_t subtree_count;
+    /* who gets the lock first, the same in the whole tree */
+    TreeLockPolicy policy;
 
-    /* condition variable on which processes wait until all processes in this Tree's subtree
-       finish their work */
-    pthread_cond_t subtree_cond;
+    /* whether tree_remove took the node out of the tree, set under its write_lock */
+    bool removed;
+
+    /* whether the node is the root, which is the first member of a TreeHeader */
+    bool is_root;
+
+    /* number of times the node got moved, odd while it is being moved, changed only while
+       its parent is write_locked. see coupled_lock_path */
+    size_t moves;
 
-    /* pointer to the parent (or is set to NULL if this tree is the root) */
-    struct Tree* parent;
 };
 
+/* what is kept once per tree: its root, and what only the root needs */
+typedef struct TreeHeader {
+    /* the root comes first, so that a pointer to it points to the header too */
+    Tree root;
+
+    /* number of times the root got write_locked, see tree_stats */
+    size_t root_write_locks;
+
+    /* the root's read indicator: N_READ_SLOTS counters whose sum is the number of readers.
+       readers of the root count themselves there instead of in its lock */
+    ReadSlot read_slots[N_READ_SLOTS];
+} TreeHeader;
+
+/* returns the header of the tree whose root is given */
+static TreeHeader* header_of(Tree* root) {
+    return (TreeHeader*) root;
+}
+
 /* checks if malloc finished successfully. if it didn't, CHECK_PTR throws syserr */
 #define CHECK_PTR(x) do { if (!x) syserr("Error in malloc\n"); } while(0)
 
+/* checks if a child got inserted into a map of children. the name is never there already,
+   so only running out of memory makes it fail, and then CHECK_INSERT throws syserr */
+#define CHECK_INSERT(x) do { if (!(x)) syserr("Error in map insert\n"); } while(0)
+
 /* checks if a system operation finished successfully. 
    if it didn't, CHECK_SYS_OP throws syserr*/
 #define CHECK_SYS_OP(op, name) do { if (op) syserr("Error in ", name, "\n"); } while(0)
@@ -46,238 +108,1054 @@ struct Tree {
     a node simultaneously, but only one can write to it at the same time. We obtain that
     behaviour by using functions called read_lock, read_unlock, write_lock and write_unlock.
 
-    Sometimes it is necessary to wait until all processes in the subtree are finished. 
-    This is performed by the subtree_wait function.
+    The whole lock of a node is one 64-bit word, changed with atomic operations: taking or
+    releasing an uncontended lock is a single compare-and-swap. A process that has to wait
+    registers in the word as a waiting reader or writer. Critical sections are short, so it
+    first spins for a while, about as long as waits for that node's lock usually last, and
+    only then sleeps on a futex. A writer that unlocks lets in all readers that wait,
+    counting them as readers itself, so that they only have to wake up, or wakes the waiting
+    writers, which compete for the lock. Who goes first depends on the tree's policy (see
+    Tree.h): readers don't get in while a writer waits unless readers are preferred, and
+    a writer lets waiting readers in before waiting writers unless writers are preferred.
+
+    Nobody waits for all processes in a subtree to finish. tree_remove only removes empty
+    folders, so it write_locks the folder and waits just for those working on it. tree_move
+    doesn't wait at all: processes inside the moved folder keep working on the same nodes,
+    and those on their way through it find out about the move, see below.
+
+    Creating or removing a child needs exclusive access to the node's map of children,
+    so by default it write_locks the node. This serializes all creates in one big folder.
+    That's why a node that gets STRIPE_THRESHOLD children is striped: its children are
+    spread over N_STRIPES maps, each protected by its own mutex. Children of a striped node
+    are created and removed under a read_lock on it and the mutex of the right stripe,
+    so different names can be created and removed in parallel. A write_lock on a striped
+    node still gives exclusive access to all its stripes. A node left with fewer than
+    UNSTRIPE_THRESHOLD children gets unstriped under a write_lock, so that listing a folder
+    that used to be big doesn't keep taking all the mutexes.
+
+    Every operation read_locks the root, so taking its mutex would make all of them contend
+    on one cache line. Instead, readers of the root count themselves in a read indicator:
+    each thread increments its own counter, out of N_READ_SLOTS on separate cache lines, and
+    then checks that no writer is there. A writer first takes the lock word and then waits
+    until all counters add up to zero, with the draining bit set. If a reader sees a writer,
+    it backs off and queues up in the lock word like readers of other nodes.
+
+    tree_list, tree_create and tree_remove first try to reach their node optimistically,
+    without locking (or writing to) the nodes on the way. Each map of children has a version,
+    which is odd while the map is being changed and grows with every change. A descent
+    notes the version of every map it looks a child up in and checks it after each step.
+    Then it locks the node it was looking for with a trylock and checks all noted versions
+    again: if none has changed, the path led to that node at that moment, and holding
+    the node's lock is enough from then on. On any conflict the descent is retried, and
+    after OPTIMISTIC_TRIES the process falls back to locking the path.
+    A descent runs in an epoch critical section (see epoch.h), and removed nodes are retired
+    instead of freed, so every node it reaches stays allocated until it is done, whatever
+    happens to the node meanwhile. Maps retire the memory they replace in the same way (see
+    HashMap.h), so a descent can look a child up while the map changes: it may find a wrong
+    child then, but the version tells, and the descent retries before it goes there. Nobody
+    waits for descents.
+
+    Even then, a process doesn't keep the whole path read_locked while it works: it locks
+    a child before unlocking its parent, and in the end holds only the node it was looking
+    for. Holding a node keeps its children from being removed, but not the node itself from
+    being moved away from above, and only a move can do that. So every node counts the times
+    it got moved, and a descent notes the count of each node on its way, while it holds
+    the node's parent. In the end it checks from the bottom up that none of them changed:
+    then the path led to the node at that moment. Only a move of a node on the path makes
+    the descent retry, and after COUPLED_TRIES the process locks the whole path, keeping
+    the ancestors read_locked.
+
+    tree_move write_locks just the two parents. It locks one of them like tree_create locks
+    a parent, waiting for it, and then finds the other one optimistically and only tries its
+    lock: until the move is checked, a concurrent move may put either parent under the other
+    one, so no order of waiting is deadlock-free. The wait comes before the epoch critical
+    section in which both parents are found. Like a descent by lock coupling, finding them
+    notes the numbers of moves of the nodes on both paths. The move begins by making that
+    of the node it moves odd, and then checks that no other one changed: the paths still
+    lead to the parents. Two moves that could make a cycle together each move a node on
+    the other one's path, so at least one of them sees the other one and is retried.
+    Only the parents stay locked, and only moves on their paths get in the way: moves
+    between unrelated folders don't wait for each other. After MOVE_TRIES the process falls
+    back to write_locking the lowest common ancestor of the parents and locking the paths
+    from it to both of them.
 */
 
-/* read_locks the node */
-static void read_lock(Tree* tree) {
-    CHECK_SYS_OP(pthread_mutex_lock(&tree->mutex), "mutex lock");
+/* fewest and most times a process waiting for a lock checks it before sleeping */
+#define MIN_SPIN 16
+#define MAX_SPIN 2048
+
+/* bits of Tree's lock word. its low 32 bits are what futex waiters wait on, so everything
+   that a waiter waits for to change is kept there: the number of readers, the writer bit,
+   the phase (flipped whenever waiting readers are let in) and the draining bit, set while
+   a writer of the root waits for its read indicator to drain.
+   the high 32 bits count processes waiting to write and waiting to read */
+#define LOCK_READER ((uint64_t) 1)
+#define LOCK_READERS (((uint64_t) 1 << 29) - 1)
+#define LOCK_DRAINING ((uint64_t) 1 << 29)
+#define LOCK_WRITER ((uint64_t) 1 << 30)
+#define LOCK_PHASE ((uint64_t) 1 << 31)
+#define LOCK_WAITING_WRITER ((uint64_t) 1 << 32)
+#define LOCK_WAITING_WRITERS ((uint64_t) 0xffff << 32)
+#define LOCK_WAITING_READER ((uint64_t) 1 << 48)
+#define LOCK_WAITING_READERS ((uint64_t) 0xffff << 48)
+
+/* returns the half of the lock word that futex waiters wait on */
+static uint32_t* lock_futex(Tree* tree) {
+    return (uint32_t*) &tree->lock + (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+}
+
+/* sleeps until the low half of the lock word stops being equal to that of word, or spuriously */
+static void lock_sleep(Tree* tree, uint64_t word) {
+    syscall(SYS_futex, lock_futex(tree), FUTEX_WAIT_PRIVATE, (uint32_t) word, NULL, NULL, 0);
+}
+
+/* wakes all processes sleeping on the lock word */
+static void lock_wake(Tree* tree) {
+    syscall(SYS_futex, lock_futex(tree), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
 
-    tree->subtree_count++;
+/* lets the processor know that the thread is busy waiting */
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* returns how many times a process waiting for the node's lock checks it before sleeping */
+static uint32_t spin_budget(Tree* tree) {
+    uint32_t budget = 2 * __atomic_load_n(&tree->spin, __ATOMIC_RELAXED) + MIN_SPIN;
+    return budget < MAX_SPIN ? budget : MAX_SPIN;
+}
 
-    if (tree->write_wait || tree->write_count) {
-        tree->read_wait++;
-        do {
-            CHECK_SYS_OP(pthread_cond_wait(&tree->read_cond, &tree->mutex), "cond wait");
-        } while (tree->write_count);
-        tree->read_wait--;
+/* waits a little for the lock word to change: busy, until spins reaches budget, then asleep */
+static void lock_pause(Tree* tree, uint64_t word, uint32_t* spins, uint32_t budget) {
+    if (*spins < budget) {
+        (*spins)++;
+        cpu_relax();
+    } else {
+        lock_sleep(tree, word);
     }
+}
 
-    /* cascade waking of other reading processes */
-    tree->read_count++;
-    CHECK_SYS_OP(pthread_cond_signal(&tree->read_cond), "cond signal");
+/* updates the node's spin estimate once a waiter got the lock after the given spins
+   a wait that ended while spinning is about as long as the rest of a critical section,
+   and the estimate follows it. a wait that had to sleep was not worth spinning for, so
+   the estimate shrinks, but the budget never drops below MIN_SPIN */
+static void spin_update(Tree* tree, uint32_t spins, uint32_t budget) {
+    int64_t spin = __atomic_load_n(&tree->spin, __ATOMIC_RELAXED);
+    if (spins < budget) spin += ((int64_t) spins - spin) / 8;
+    else spin -= spin / 8;
+    __atomic_store_n(&tree->spin, (uint32_t) spin, __ATOMIC_RELAXED);
+}
 
-    CHECK_SYS_OP(pthread_mutex_unlock(&tree->mutex), "mutex unlock");
+/* returns if a reader may take the lock of the node: nobody writes, nor waits to unless
+   readers are preferred */
+static bool read_admitted(Tree* tree, uint64_t word) {
+    if (tree->policy == TREE_READER_PREFERENCE) return !(word & LOCK_WRITER);
+    return !(word & (LOCK_WRITER | LOCK_WAITING_WRITERS));
 }
 
-/* read_unlocks the node */
-static void read_unlock(Tree* tree) {
-    CHECK_SYS_OP(pthread_mutex_lock(&tree->mutex), "mutex lock");
+/* returns if a writer may take the lock: nobody reads nor writes */
+static bool write_admitted(uint64_t word) {
+    return !(word & (LOCK_WRITER | LOCK_READERS));
+}
 
-    if (--tree->read_count == 0) CHECK_SYS_OP(pthread_cond_signal(&tree->write_cond), "cond signal");
+/* wakes the writer of the root waiting in write_lock_root, if there is one */
+static void wake_draining(Tree* tree, uint64_t word) {
+    if (!(word & LOCK_DRAINING)) return;
+    __atomic_fetch_and(&tree->lock, ~LOCK_DRAINING, __ATOMIC_SEQ_CST);
+    lock_wake(tree);
+}
 
-    if (--tree->subtree_count <= 1) CHECK_SYS_OP(pthread_cond_signal(&tree->subtree_cond), "cond signal");
+/* read_locks the lock word of the node, see above */
+static void word_read_lock(Tree* tree) {
+    uint64_t word = __atomic_load_n(&tree->lock, __ATOMIC_RELAXED);
+    for (;;) {
+        if (read_admitted(tree, word)) {
+            if (__atomic_compare_exchange_n(&tree->lock, &word, word + LOCK_READER, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+        } else if (__atomic_compare_exchange_n(&tree->lock, &word, word + LOCK_WAITING_READER, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
 
-    CHECK_SYS_OP(pthread_mutex_unlock(&tree->mutex), "mutex unlock");
+    /* write_unlock counts this process as a reader when it flips the phase */
+    uint64_t phase = word & LOCK_PHASE;
+    uint32_t budget = spin_budget(tree), spins = 0;
+    do {
+        lock_pause(tree, word, &spins, budget);
+        word = __atomic_load_n(&tree->lock, __ATOMIC_ACQUIRE);
+    } while ((word & LOCK_PHASE) == phase);
+    spin_update(tree, spins, budget);
 }
 
-/* write_locks the node */
-static void write_lock(Tree* tree) {
-    CHECK_SYS_OP(pthread_mutex_lock(&tree->mutex), "mutex lock");
+/* read_unlocks the lock word of the node */
+static void word_read_unlock(Tree* tree) {
+    uint64_t word = __atomic_sub_fetch(&tree->lock, LOCK_READER, __ATOMIC_RELEASE);
+    if (!(word & LOCK_READERS) && (word & LOCK_WAITING_WRITERS)) lock_wake(tree);
+}
 
-    tree->subtree_count++;
+/* write_locks the lock word of the node */
+static void word_write_lock(Tree* tree) {
+    uint64_t word = __atomic_load_n(&tree->lock, __ATOMIC_RELAXED);
+    if (write_admitted(word) && __atomic_compare_exchange_n(&tree->lock, &word, word | LOCK_WRITER, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+
+    word = __atomic_add_fetch(&tree->lock, LOCK_WAITING_WRITER, __ATOMIC_RELAXED);
+    uint32_t budget = spin_budget(tree), spins = 0;
+    for (;;) {
+        if (!write_admitted(word)) {
+            lock_pause(tree, word, &spins, budget);
+            word = __atomic_load_n(&tree->lock, __ATOMIC_RELAXED);
+        } else if (__atomic_compare_exchange_n(&tree->lock, &word, (word - LOCK_WAITING_WRITER) | LOCK_WRITER, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            spin_update(tree, spins, budget);
+            return;
+        }
+    }
+}
+
+/* returns word with the waiting readers let in: counted as readers, under a new phase */
+static uint64_t admit_readers(uint64_t word) {
+    uint64_t waiting = (word & LOCK_WAITING_READERS) / LOCK_WAITING_READER;
+    return ((word & ~LOCK_WAITING_READERS) + waiting * LOCK_READER) ^ LOCK_PHASE;
+}
+
+/* write_unlocks the lock word of the node, letting in the readers that wait if there are any,
+   unless writers are preferred and some wait too */
+static void word_write_unlock(Tree* tree) {
+    uint64_t word = __atomic_load_n(&tree->lock, __ATOMIC_RELAXED), next;
+    do {
+        next = word & ~(LOCK_WRITER | LOCK_DRAINING);
+        bool readers_first = tree->policy != TREE_WRITER_PREFERENCE || !(next & LOCK_WAITING_WRITERS);
+        if ((next & LOCK_WAITING_READERS) && readers_first) next = admit_readers(next);
+    } while (!__atomic_compare_exchange_n(&tree->lock, &word, next, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (word & (LOCK_WAITING_READERS | LOCK_WAITING_WRITERS | LOCK_DRAINING)) lock_wake(tree);
+}
+
+/* returns the counter of the root's read indicator that the calling thread uses */
+static size_t* read_slot(Tree* root) {
+    static size_t n_threads = 0;
+    static _Thread_local size_t thread_id = 0;
+    if (!thread_id) thread_id = __atomic_add_fetch(&n_threads, 1, __ATOMIC_RELAXED);
+    return &header_of(root)->read_slots[thread_id % N_READ_SLOTS].count;
+}
+
+/* returns the number of readers of the root counted in its read indicator */
+static size_t read_indicator_sum(Tree* root) {
+    size_t result = 0;
+    for (size_t i = 0; i < N_READ_SLOTS; i++) result += __atomic_load_n(&header_of(root)->read_slots[i].count, __ATOMIC_SEQ_CST);
+    return result;
+}
+
+/* read_locks the root using its read indicator, see above
+   the counter is incremented before the lock word is checked, and a writer sets its bit
+   before summing up the counters, so one of them always sees the other */
+static void read_lock_root(Tree* root) {
+    size_t* slot = read_slot(root);
+    __atomic_add_fetch(slot, 1, __ATOMIC_SEQ_CST);
+    uint64_t word = __atomic_load_n(&root->lock, __ATOMIC_SEQ_CST);
+    if (read_admitted(root, word)) return;
+
+    /* back off, the writer may be waiting for this counter */
+    __atomic_sub_fetch(slot, 1, __ATOMIC_SEQ_CST);
+    wake_draining(root, __atomic_load_n(&root->lock, __ATOMIC_SEQ_CST));
+
+    /* a writer takes the lock word only once it is not read_locked,
+       and then sums up the counters, including this one */
+    word_read_lock(root);
+    __atomic_add_fetch(slot, 1, __ATOMIC_SEQ_CST);
+    word_read_unlock(root);
+}
+
+/* read_unlocks the root locked by read_lock_root */
+static void read_unlock_root(Tree* root) {
+    __atomic_sub_fetch(read_slot(root), 1, __ATOMIC_SEQ_CST);
+    wake_draining(root, __atomic_load_n(&root->lock, __ATOMIC_SEQ_CST));
+}
 
-    while (tree->write_count || tree->read_count) {
-        tree->write_wait++;
-        CHECK_SYS_OP(pthread_cond_wait(&tree->write_cond, &tree->mutex), "cond wait");
-        tree->write_wait--;
+/* write_locks the root: takes its lock word and waits for the readers in the read indicator */
+static void write_lock_root(Tree* root) {
+    word_write_lock(root);
+    while (read_indicator_sum(root)) {
+        uint64_t word = __atomic_or_fetch(&root->lock, LOCK_DRAINING, __ATOMIC_SEQ_CST);
+        if (!read_indicator_sum(root)) break;
+        lock_sleep(root, word);
     }
+    __atomic_add_fetch(&header_of(root)->root_write_locks, 1, __ATOMIC_RELAXED);
+}
 
-    tree->write_count++;
+/* read_locks the node */
+static void read_lock(Tree* tree) {
+    if (tree->is_root) read_lock_root(tree);
+    else word_read_lock(tree);
+}
 
-    CHECK_SYS_OP(pthread_mutex_unlock(&tree->mutex), "mutex unlock");
+/* read_unlocks the node */
+static void read_unlock(Tree* tree) {
+    if (tree->is_root) read_unlock_root(tree);
+    else word_read_unlock(tree);
+}
+
+/* write_locks the node */
+static void write_lock(Tree* tree) {
+    if (tree->is_root) write_lock_root(tree);
+    else word_write_lock(tree);
 }
 
 /* write_unlocks the node */
 static void write_unlock(Tree* tree) {
-    CHECK_SYS_OP(pthread_mutex_lock(&tree->mutex), "mutex lock");
+    word_write_unlock(tree);
+}
 
-    tree->write_count--;
-    
-    if (tree->read_wait) CHECK_SYS_OP(pthread_cond_signal(&tree->read_cond), "cond signal");
-    else CHECK_SYS_OP(pthread_cond_signal(&tree->write_cond), "cond signal");
-    
-    if (--tree->subtree_count <= 1) CHECK_SYS_OP(pthread_cond_signal(&tree->subtree_cond), "cond signal");
+/* returns the stripe that holds the child with the given name of the given length */
+static Stripe* stripe_of(Stripe* stripes, const char* name, size_t length) {
+    /* seeding with the address makes every node spread the names differently */
+    return &stripes[hmap_hash(name, length, (uintptr_t) stripes) % N_STRIPES];
+}
 
-    CHECK_SYS_OP(pthread_mutex_unlock(&tree->mutex), "mutex unlock");
+/* locks the stripe that holds the child with the given name, and returns it
+   returns NULL if the node isn't striped. the node must be locked */
+static Stripe* stripe_lock(Tree* tree, const char* name, size_t length) {
+    if (!tree->stripes) return NULL;
+    Stripe* stripe = stripe_of(tree->stripes, name, length);
+    CHECK_SYS_OP(pthread_mutex_lock(&stripe->mutex), "mutex lock");
+    return stripe;
 }
 
-/* waits for all processes in the subtree to finish
-   note that in order to make this function work properly, 
-   we need to write_lock this tree's parent, so that other processes
-   cannot enter this node while someone is waiting for all processes to finish */
-static void subtree_wait(Tree* tree) {
-    CHECK_SYS_OP(pthread_mutex_lock(&tree->mutex), "mutex lock");
-    
-    tree->subtree_count++;
-    while (tree->subtree_count > 1) CHECK_SYS_OP(pthread_cond_wait(&tree->subtree_cond, &tree->mutex), "cond wait");
-    tree->subtree_count--;
+/* returns the version of the map that holds the child with the given name, see children_map */
+static size_t* children_version(Tree* tree, const char* name, size_t length) {
+    return tree->stripes ? &stripe_of(tree->stripes, name, length)->version : &tree->version;
+}
 
-    CHECK_SYS_OP(pthread_mutex_unlock(&tree->mutex), "mutex unlock");
+/* unlocks the stripe returned by stripe_lock */
+static void stripe_unlock(Stripe* stripe) {
+    if (stripe) CHECK_SYS_OP(pthread_mutex_unlock(&stripe->mutex), "mutex unlock");
 }
 
-/* read_unlocks the tree and all its predecessors */
-static void read_unlock_predecessors(Tree* tree) {
-    read_unlock(tree);
-    if (tree->parent) read_unlock_predecessors(tree->parent);
+/* returns the map that holds the child with the given name
+   the node must be write_locked, or the child's stripe locked */
+static HashMap* children_map(Tree* tree, const char* name, size_t length) {
+    return tree->stripes ? &stripe_of(tree->stripes, name, length)->map : &tree->map;
 }
 
-Tree* tree_new() {
+/* stores all maps of children of the node in maps, returns their number */
+static size_t children_maps(Tree* tree, HashMap* maps[N_STRIPES]) {
+    if (!tree->stripes) {
+        maps[0] = &tree->map;
+        return 1;
+    }
+    for (size_t i = 0; i < N_STRIPES; i++) maps[i] = &tree->stripes[i].map;
+    return N_STRIPES;
+}
+
+/* returns the number of children of a node that nobody else can modify */
+static size_t children_count(Tree* tree) {
+    HashMap* maps[N_STRIPES];
+    size_t n_maps = children_maps(tree, maps), result = 0;
+    for (size_t i = 0; i < n_maps; i++) result += hmap_size(maps[i]);
+    return result;
+}
+
+/* lists the children of a read_locked node, see tree_list */
+static char* children_string(Tree* tree) {
+    HashMap* maps[N_STRIPES];
+    size_t n_maps = children_maps(tree, maps);
+    if (tree->stripes) {
+        for (size_t i = 0; i < N_STRIPES; i++) CHECK_SYS_OP(pthread_mutex_lock(&tree->stripes[i].mutex), "mutex lock");
+    }
+    char* result = make_maps_contents_string(maps, n_maps);
+    if (tree->stripes) {
+        for (size_t i = 0; i < N_STRIPES; i++) CHECK_SYS_OP(pthread_mutex_unlock(&tree->stripes[i].mutex), "mutex unlock");
+    }
+    return result;
+}
+
+/* starts changing a map of children, whose version is given: makes the version odd,
+   so that optimistic descents that look at the map meanwhile back off
+   the caller has to be the only one changing that map */
+static void version_begin(size_t* version) {
+    __atomic_add_fetch(version, 1, __ATOMIC_SEQ_CST);
+}
+
+/* finishes the change started by version_begin */
+static void version_end(size_t* version) {
+    __atomic_add_fetch(version, 1, __ATOMIC_RELEASE);
+}
+
+/* stripes the write_locked node if it has enough children */
+static void stripe_if_big(Tree* tree) {
+    if (tree->stripes || hmap_size(&tree->map) < STRIPE_THRESHOLD) return;
+
+    Stripe* stripes = malloc(N_STRIPES * sizeof(Stripe));
+    CHECK_PTR(stripes);
+    for (size_t i = 0; i < N_STRIPES; i++) {
+        CHECK_SYS_OP(pthread_mutex_init(&stripes[i].mutex, NULL), "mutex init");
+        hmap_init(&stripes[i].map);
+    }
+
+    for (size_t i = 0; i < N_STRIPES; i++) stripes[i].version = 0;
+
+    const char* key = NULL;
+    void* value = NULL;
+    HashMapIterator it = hmap_iterator(&tree->map);
+    while (hmap_next(&tree->map, &it, &key, &value)) {
+        CHECK_INSERT(hmap_insert(&stripe_of(stripes, key, strlen(key))->map, key, value));
+    }
+
+    /* lock_node and optimistic descents peek at stripes without holding any lock. map is
+       emptied by removals, which retire its memory, since descents may still look at it */
+    version_begin(&tree->version);
+    __atomic_store_n(&tree->stripes, stripes, __ATOMIC_RELEASE);
+    while (hmap_size(&tree->map)) {
+        it = hmap_iterator(&tree->map);
+        hmap_next(&tree->map, &it, &key, &value);
+        hmap_remove(&tree->map, key);
+    }
+    version_end(&tree->version);
+}
+
+/* frees the stripes of a node and their maps, but not the children in them */
+static void stripes_free(Stripe* stripes) {
+    for (size_t i = 0; i < N_STRIPES; i++) {
+        hmap_destroy(&stripes[i].map);
+        CHECK_SYS_OP(pthread_mutex_destroy(&stripes[i].mutex), "mutex destroy");
+    }
+    free(stripes);
+}
+
+/* frees stripes retired by unstripe_if_small */
+static void retired_stripes_free(void* stripes) {
+    stripes_free(stripes);
+}
+
+/* unstripes the write_locked node if it has few children left */
+static void unstripe_if_small(Tree* tree) {
+    Stripe* stripes = tree->stripes;
+    if (!stripes || children_count(tree) >= UNSTRIPE_THRESHOLD) return;
+
+    /* optimistic descents may still be looking at the stripes, so they are retired. their
+       versions stay odd for good, so that the descents that noted one retry */
+    version_begin(&tree->version);
+    for (size_t i = 0; i < N_STRIPES; i++) {
+        version_begin(&stripes[i].version);
+        const char* key = NULL;
+        void* value = NULL;
+        HashMapIterator it = hmap_iterator(&stripes[i].map);
+        while (hmap_next(&stripes[i].map, &it, &key, &value)) {
+            CHECK_INSERT(hmap_insert(&tree->map, key, value));
+        }
+    }
+    __atomic_store_n(&tree->stripes, NULL, __ATOMIC_RELEASE);
+    version_end(&tree->version);
+    epoch_retire(stripes, retired_stripes_free);
+}
+
+/* makes result a node other than the root without children, with the given lock policy,
+   see tree_new_with_policy */
+static void node_init(Tree* result, TreeLockPolicy policy) {
+    hmap_init(&result->map);
+    result->stripes = NULL;
+    result->version = 0;
+
+    result->lock = 0;
+    result->spin = 0;
+    result->policy = policy;
+    result->removed = false;
+    result->is_root = false;
+    result->moves = 0;
+}
+
+/* creates a node other than the root without children, with the given lock policy */
+static Tree* node_new(TreeLockPolicy policy) {
     Tree* result = (Tree*) malloc(sizeof(Tree));
     CHECK_PTR(result);
+    node_init(result, policy);
+    return result;
+}
 
-    result->map = hmap_new();
-    CHECK_PTR(result->map);
+Tree* tree_new() {
+    return tree_new_with_policy(TREE_PHASE_FAIR);
+}
 
-    CHECK_SYS_OP(pthread_mutex_init(&result->mutex, NULL), "mutex init");
-    CHECK_SYS_OP(pthread_cond_init(&result->read_cond, NULL), "cond init");
-    CHECK_SYS_OP(pthread_cond_init(&result->write_cond, NULL), "cond init");
-    CHECK_SYS_OP(pthread_cond_init(&result->subtree_cond, NULL), "cond init");
+Tree* tree_new_with_policy(TreeLockPolicy policy) {
+    TreeHeader* header = aligned_alloc(CACHE_LINE, sizeof(TreeHeader));
+    CHECK_PTR(header);
+    node_init(&header->root, policy);
+    header->root.is_root = true;
+    header->root_write_locks = 0;
+    for (size_t i = 0; i < N_READ_SLOTS; i++) header->read_slots[i].count = 0;
+    return &header->root;
+}
 
-    result->read_wait = result->write_wait = result->write_count = result->read_count = 0;
-    result->subtree_count = 0;
-    result->parent = NULL;
+/* frees the node and its subtree, keeping the nodes yet to be freed on an explicit stack
+   freeing the root frees the header of the tree, which starts at the same address */
+static void node_free(Tree* tree) {
+    size_t n_nodes = 1, capacity = 16;
+    Tree** nodes = malloc(capacity * sizeof(Tree*));
+    CHECK_PTR(nodes);
+    nodes[0] = tree;
+    while (n_nodes) {
+        Tree* node = nodes[--n_nodes];
+        HashMap* maps[N_STRIPES];
+        size_t n_maps = children_maps(node, maps);
+        for (size_t i = 0; i < n_maps; i++) {
+            const char* key = NULL;
+            void* value = NULL;
+            HashMapIterator it = hmap_iterator(maps[i]);
+            while (hmap_next(maps[i], &it, &key, &value)) {
+                if (n_nodes == capacity) {
+                    capacity *= 2;
+                    nodes = realloc(nodes, capacity * sizeof(Tree*));
+                    CHECK_PTR(nodes);
+                }
+                nodes[n_nodes++] = value;
+            }
+        }
+        hmap_destroy(&node->map);
+        if (node->stripes) stripes_free(node->stripes);
+        free(node);
+    }
+    free(nodes);
+}
 
-    return result;
+/* frees a node retired by tree_remove */
+static void retired_node_free(void* tree) {
+    node_free(tree);
 }
 
 void tree_free(Tree *tree) {
-    const char* key = NULL;
-    void* value = NULL;
-    HashMapIterator it = hmap_iterator(tree->map);
-    while (hmap_next(tree->map, &it, &key, &value)) {
-        tree_free(value);
+    node_free(tree);
+    /* nodes removed from the tree may still wait for a grace period */
+    epoch_barrier();
+}
+
+/* returns if the path is path to root */
+static bool is_root(const char* path) {
+    return !strcmp(path, "/");
+}
+
+/* the way the last node of a path gets locked */
+typedef enum LockMode {
+    LOCK_READ,
+    LOCK_WRITE,
+    /* enough to create and remove children: read_lock if the node is striped, write_lock otherwise */
+    LOCK_UPDATE
+} LockMode;
+
+/* locks the node in the given mode, returns true if it got write_locked */
+static bool lock_node(Tree* tree, LockMode mode) {
+    if (mode == LOCK_READ) {
+        read_lock(tree);
+        return false;
+    }
+    if (mode == LOCK_UPDATE && __atomic_load_n(&tree->stripes, __ATOMIC_ACQUIRE)) {
+        read_lock(tree);
+        /* the node may have got unstriped before it got locked */
+        if (tree->stripes) return false;
+        read_unlock(tree);
     }
-    hmap_free(tree->map);
-    CHECK_SYS_OP(pthread_mutex_destroy(&tree->mutex), "mutex destroy");
-    CHECK_SYS_OP(pthread_cond_destroy(&tree->read_cond), "cond destroy");
-    CHECK_SYS_OP(pthread_cond_destroy(&tree->write_cond), "cond destroy");
-    CHECK_SYS_OP(pthread_cond_destroy(&tree->subtree_cond), "cond destroy");
-    free(tree);
+    write_lock(tree);
+    return true;
 }
 
-/* read_locks whole path, returns the node that the path points to
-   if such path doesn't exist, returns NULL and rollbacks all read_locks */
-static Tree* read_lock_path(Tree* tree, const char* path) {
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    const char* subpath = path;
-    subpath = split_path(subpath, component);
+/* unlocks the node locked by lock_node */
+static void unlock_node(Tree* tree, bool exclusive) {
+    if (exclusive) write_unlock(tree);
+    else read_unlock(tree);
+}
+
+/* number of nodes a cursor holds without allocating memory */
+#define CURSOR_INLINE_NODES 16
+
+/* the nodes that a process holds locked, in the order it locked them: all of them
+   read_locked except for the last one, locked by lock_node
+   the nodes are kept in inline_nodes, or in an allocated array on deeper paths */
+typedef struct LockCursor {
+    Tree** nodes;
+    size_t n_nodes, capacity;
+
+    /* what lock_node returned for the last node */
+    bool exclusive;
+
+    Tree* inline_nodes[CURSOR_INLINE_NODES];
+} LockCursor;
 
+/* makes the cursor hold no nodes */
+static void cursor_init(LockCursor* cursor) {
+    cursor->nodes = cursor->inline_nodes;
+    cursor->n_nodes = 0;
+    cursor->capacity = CURSOR_INLINE_NODES;
+    cursor->exclusive = false;
+}
+
+/* adds a node that the process has just locked to the cursor */
+static void cursor_push(LockCursor* cursor, Tree* tree) {
+    if (cursor->n_nodes == cursor->capacity) {
+        Tree** nodes = malloc(2 * cursor->capacity * sizeof(Tree*));
+        CHECK_PTR(nodes);
+        memcpy(nodes, cursor->nodes, cursor->n_nodes * sizeof(Tree*));
+        if (cursor->nodes != cursor->inline_nodes) free(cursor->nodes);
+        cursor->nodes = nodes;
+        cursor->capacity *= 2;
+    }
+    cursor->nodes[cursor->n_nodes++] = tree;
+}
+
+/* unlocks all nodes held by the cursor, the last one first, and makes it hold none */
+static void cursor_unlock(LockCursor* cursor) {
+    if (cursor->n_nodes) unlock_node(cursor->nodes[cursor->n_nodes - 1], cursor->exclusive);
+    for (size_t i = cursor->n_nodes; i-- > 1;) read_unlock(cursor->nodes[i - 1]);
+    if (cursor->nodes != cursor->inline_nodes) free(cursor->nodes);
+    cursor_init(cursor);
+}
+
+/* the functions below lock only the part of path up to end, which points to one of its '/'
+   characters, so that e.g. the parent of "/a/b/" is locked without copying "/a/".
+   components are looked up in place, without copying them either */
+
+/* read_locks whole path below the already locked tree, except for the last node,
+   which is locked in the given mode, adding the nodes to the cursor
+   returns the node that the path points to, which mustn't be tree itself (so path < end)
+   if such path doesn't exist, returns NULL and unlocks all nodes held by the cursor
+   (tree included only if the cursor holds it) */
+static Tree* lock_subpath(LockCursor* cursor, Tree* tree, const char* path, const char* end, LockMode mode) {
+    for (;;) {
+        const char* subpath = split_path(path, NULL);
+        const char* name = path + 1;
+        size_t length = subpath - name;
+
+        /* the stripe is held until the child is locked, so that nobody removes it in the meantime */
+        Stripe* stripe = stripe_lock(tree, name, length);
+        Tree* subtree = (Tree*) hmap_get_n(children_map(tree, name, length), name, length);
+        if (!subtree) {
+            stripe_unlock(stripe);
+            cursor_unlock(cursor);
+            return NULL;
+        }
+        if (subpath == end) {
+            cursor->exclusive = lock_node(subtree, mode);
+            stripe_unlock(stripe);
+            cursor_push(cursor, subtree);
+            return subtree;
+        }
+        read_lock(subtree);
+        stripe_unlock(stripe);
+        cursor_push(cursor, subtree);
+        tree = subtree;
+        path = subpath;
+    }
+}
+
+/* read_locks whole path, except for the last node, which is locked in the given mode,
+   adding the nodes to the cursor. returns the node that the path points to
+   if such path doesn't exist, returns NULL and unlocks all nodes held by the cursor */
+static Tree* lock_path(LockCursor* cursor, Tree* tree, const char* path, const char* end, LockMode mode) {
+    if (path == end) {
+        cursor->exclusive = lock_node(tree, mode);
+        cursor_push(cursor, tree);
+        return tree;
+    }
     read_lock(tree);
-    if (!subpath) return tree;
+    cursor_push(cursor, tree);
+    return lock_subpath(cursor, tree, path, end, mode);
+}
+
+/* returns the final '/' character of the path */
+static const char* path_end(const char* path) {
+    return path + strlen(path) - 1;
+}
+
+/* read_locks whole path, returns the node that the path points to
+   if such path doesn't exist, returns NULL and unlocks all nodes held by the cursor */
+static Tree* read_lock_path(LockCursor* cursor, Tree* tree, const char* path) {
+    return lock_path(cursor, tree, path, path_end(path), LOCK_READ);
+}
+
+/* number of optimistic descents tried before locking the whole path */
+#define OPTIMISTIC_TRIES 4
+
+/* a step of an optimistic descent: the child found and the version of the map it was found in */
+typedef struct Step {
+    Tree* child;
+    size_t* version;
+    size_t value;
+} Step;
+
+/* number of steps a descent notes without allocating memory */
+#define INLINE_STEPS 16
+
+/* the steps of a descent, kept in inline_steps, or in an allocated array on deeper paths */
+typedef struct StepList {
+    Step* steps;
+    size_t n_steps, capacity;
+    Step inline_steps[INLINE_STEPS];
+} StepList;
+
+/* makes the list hold no steps */
+static void steps_init(StepList* list) {
+    list->steps = list->inline_steps;
+    list->n_steps = 0;
+    list->capacity = INLINE_STEPS;
+}
 
-    Tree* subtree = (Tree*) hmap_get(tree->map, component);
-    if (!subtree) {
-        read_unlock_predecessors(tree);
-        return NULL;
+/* adds a step to the list and returns it, to be filled by the caller */
+static Step* steps_push(StepList* list) {
+    if (list->n_steps == list->capacity) {
+        Step* steps = malloc(2 * list->capacity * sizeof(Step));
+        CHECK_PTR(steps);
+        memcpy(steps, list->steps, list->n_steps * sizeof(Step));
+        if (list->steps != list->inline_steps) free(list->steps);
+        list->steps = steps;
+        list->capacity *= 2;
     }
-    return read_lock_path(subtree, subpath);
+    return &list->steps[list->n_steps++];
 }
 
-char* tree_list(Tree* tree, const char* path) {
-    if (!is_path_valid(path)) return NULL;
+/* frees the memory allocated by steps_push */
+static void steps_free(StepList* list) {
+    if (list->steps != list->inline_steps) free(list->steps);
+}
 
-    Tree* node = read_lock_path(tree, path);
-    if (!node) return NULL;
+/* read_locks a node other than the root unless someone writes to it or waits to,
+   returns whether it did */
+static bool read_trylock(Tree* tree) {
+    uint64_t word = __atomic_load_n(&tree->lock, __ATOMIC_RELAXED);
+    while (read_admitted(tree, word)) {
+        if (__atomic_compare_exchange_n(&tree->lock, &word, word + LOCK_READER, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return true;
+    }
+    return false;
+}
+
+/* write_locks a node other than the root unless someone reads or writes it, returns whether it did */
+static bool write_trylock(Tree* tree) {
+    uint64_t word = __atomic_load_n(&tree->lock, __ATOMIC_RELAXED);
+    while (write_admitted(word)) {
+        if (__atomic_compare_exchange_n(&tree->lock, &word, word | LOCK_WRITER, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return true;
+    }
+    return false;
+}
+
+/* looks up the child with the given name of the node and fills step
+   returns false if the map is being changed */
+static bool optimistic_step(Tree* tree, const char* name, size_t length, Step* step) {
+    size_t version = __atomic_load_n(&tree->version, __ATOMIC_SEQ_CST);
+    if (version & 1) return false;
+
+    HashMap* map = &tree->map;
+    Stripe* stripes = __atomic_load_n(&tree->stripes, __ATOMIC_ACQUIRE);
+    if (stripes) {
+        Stripe* stripe = stripe_of(stripes, name, length);
+        step->version = &stripe->version;
+        step->value = __atomic_load_n(&stripe->version, __ATOMIC_SEQ_CST);
+        if (step->value & 1) return false;
+        map = &stripe->map;
+    } else {
+        step->version = &tree->version;
+        step->value = version;
+    }
+    step->child = hmap_get_n(map, name, length);
+    return true;
+}
 
-    char* result = make_map_contents_string(node->map);
-    read_unlock(node);
-    if (node->parent) read_unlock_predecessors(node->parent);
+/* checks again that none of the counters noted by the steps of a descent changed: versions
+   of the maps looked into or, see coupled_lock_path, numbers of moves of the nodes found
+   the last step is checked first */
+static bool steps_validate(StepList* list) {
+    for (size_t i = list->n_steps; i-- > 0;) {
+        if (__atomic_load_n(list->steps[i].version, __ATOMIC_SEQ_CST) != list->steps[i].value) return false;
+    }
+    return true;
+}
+
+/* tries to find the node that the part of path up to end points to (path < end) without
+   locking anything on the way, see above. then locks it with a trylock in the given mode
+   (exclusive is set to whether it got write_locked) and returns it
+   returns NULL and sets *conflict to false if the path doesn't exist, or sets it to true
+   if the descent has to be retried */
+static Tree* optimistic_lock_path(Tree* tree, const char* path, const char* end, LockMode mode, bool* exclusive, bool* conflict) {
+    StepList steps;
+    steps_init(&steps);
+    Tree* node = tree;
+    Tree* result = NULL;
+    *conflict = true;
+
+    epoch_enter();
+    while (path != end) {
+        const char* subpath = split_path(path, NULL);
+        Step* step = steps_push(&steps);
+        if (!optimistic_step(node, path + 1, subpath - path - 1, step)) goto out;
+        if (__atomic_load_n(step->version, __ATOMIC_SEQ_CST) != step->value) goto out;
+        if (!step->child) {
+            if (steps_validate(&steps)) *conflict = false;
+            goto out;
+        }
+        node = step->child;
+        path = subpath;
+    }
+
+    bool locked_exclusive = mode == LOCK_WRITE || (mode == LOCK_UPDATE && !__atomic_load_n(&node->stripes, __ATOMIC_ACQUIRE));
+    if (!(locked_exclusive ? write_trylock(node) : read_trylock(node))) goto out;
+    /* the node may have got unstriped before it got locked, see lock_node */
+    if (!steps_validate(&steps) || (!locked_exclusive && mode == LOCK_UPDATE && !node->stripes)) {
+        unlock_node(node, locked_exclusive);
+        goto out;
+    }
+    *exclusive = locked_exclusive;
+    *conflict = false;
+    result = node;
+
+out:
+    /* from now on the node is kept by its lock: whoever removes it waits for that */
+    epoch_exit();
+    steps_free(&steps);
     return result;
 }
 
-/* read_locks whole path, except for the last node, which is write_locked
-   returns the node that the path points to
-   if such path doesn't exist, returns NULL and rollbacks all read_locks */
-static Tree* read_write_lock_path(Tree* tree, const char* path) {
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    const char* subpath = path;
-    subpath = split_path(subpath, component);
+/* finds the node that the part of path up to end points to like optimistic_lock_path, but
+   without locking it. instead of versions of maps, the steps note the numbers of moves of
+   the nodes found, see coupled_lock_path: until one of them changes, the path leads to
+   the node, unless the node itself gets removed
+   returns NULL if the path doesn't exist, a map on the way was being changed or a node
+   on the way was being moved. the caller has to be in an epoch critical section */
+static Tree* optimistic_find(Tree* tree, const char* path, const char* end, StepList* steps) {
+    Tree* node = tree;
+    while (node && path != end) {
+        const char* subpath = split_path(path, NULL);
+        Step map_step;
+        if (!optimistic_step(node, path + 1, subpath - path - 1, &map_step)) return NULL;
+        node = map_step.child;
+        if (node) {
+            Step* step = steps_push(steps);
+            step->child = node;
+            step->version = &node->moves;
+            step->value = __atomic_load_n(&node->moves, __ATOMIC_SEQ_CST);
+            if (step->value & 1) return NULL;
+        }
+        /* checked after the number of moves is read, so that it is that of a node in the map */
+        if (__atomic_load_n(map_step.version, __ATOMIC_SEQ_CST) != map_step.value) return NULL;
+        path = subpath;
+    }
+    return node;
+}
+
+/* number of descents by lock coupling tried before locking the whole path */
+#define COUPLED_TRIES 4
 
-    if (!subpath) {
-        write_lock(tree);
-        return tree;
+/* starts moving the node, whose parent has to be write_locked, see coupled_lock_path */
+static void move_begin(Tree* node) {
+    __atomic_add_fetch(&node->moves, 1, __ATOMIC_SEQ_CST);
+}
+
+/* finishes the move started by move_begin */
+static void move_end(Tree* node) {
+    __atomic_add_fetch(&node->moves, 1, __ATOMIC_SEQ_CST);
+}
+
+/* checks that none of the nodes found by the steps of a descent by lock coupling got moved
+   since the step, see above. the node found by the last step has to be locked
+   a node that didn't get moved is still a child of the node found by the step before,
+   which therefore is still allocated, and so on up */
+static bool coupled_validate(StepList* steps) {
+    epoch_enter();
+    bool result = steps_validate(steps);
+    epoch_exit();
+    return result;
+}
+
+/* locks the node that the part of path up to the end points to (path < end) in the given mode
+   by lock coupling, see above (exclusive is set to what lock_node returned), and returns it
+   returns NULL and sets *conflict to false if the path doesn't exist, or sets it to true
+   if a move may have changed the path meanwhile and the descent has to be retried */
+static Tree* coupled_lock_path(Tree* tree, const char* path, const char* end, LockMode mode, bool* exclusive, bool* conflict) {
+    StepList steps;
+    steps_init(&steps);
+    Tree* node = tree;
+    Tree* result = NULL;
+    *conflict = true;
+    read_lock(node);
+    for (;;) {
+        const char* subpath = split_path(path, NULL);
+        const char* name = path + 1;
+        size_t length = subpath - name;
+
+        Stripe* stripe = stripe_lock(node, name, length);
+        Tree* child = (Tree*) hmap_get_n(children_map(node, name, length), name, length);
+        if (!child) {
+            stripe_unlock(stripe);
+            *conflict = !coupled_validate(&steps);
+            read_unlock(node);
+            break;
+        }
+        /* nobody moves child while node is locked */
+        Step* step = steps_push(&steps);
+        step->child = child;
+        step->version = &child->moves;
+        step->value = __atomic_load_n(&child->moves, __ATOMIC_SEQ_CST);
+
+        bool locked_exclusive = false;
+        if (subpath == end) locked_exclusive = lock_node(child, mode);
+        else read_lock(child);
+        stripe_unlock(stripe);
+        read_unlock(node);
+        node = child;
+        path = subpath;
+
+        if (path == end) {
+            if (!coupled_validate(&steps)) {
+                unlock_node(node, locked_exclusive);
+                break;
+            }
+            *exclusive = locked_exclusive;
+            *conflict = false;
+            result = node;
+            break;
+        }
     }
-    read_lock(tree);
+    steps_free(&steps);
+    return result;
+}
 
-    Tree* subtree = (Tree*) hmap_get(tree->map, component);
-    if (!subtree) {
-        read_unlock_predecessors(tree);
-        return NULL;
+/* locks the node that the part of path up to end points to in the given mode, like lock_path,
+   first trying optimistic descents and then descents by lock coupling, after which
+   the cursor holds only that node. returns NULL if such path doesn't exist */
+static Tree* lock_target(LockCursor* cursor, Tree* tree, const char* path, const char* end, LockMode mode) {
+    if (path == end) return lock_path(cursor, tree, path, end, mode);
+    for (size_t i = 0; i < OPTIMISTIC_TRIES + COUPLED_TRIES; i++) {
+        bool conflict;
+        Tree* result = i < OPTIMISTIC_TRIES
+            ? optimistic_lock_path(tree, path, end, mode, &cursor->exclusive, &conflict)
+            : coupled_lock_path(tree, path, end, mode, &cursor->exclusive, &conflict);
+        if (!conflict) {
+            if (result) cursor_push(cursor, result);
+            return result;
+        }
     }
-    return read_write_lock_path(subtree, subpath);
+    return lock_path(cursor, tree, path, end, mode);
 }
 
-/* returns if the path is path to root */
-static bool is_root(const char* path) {
-    return !strcmp(path, "/");
+char* tree_list(Tree* tree, const char* path) {
+    if (!is_path_valid(path)) return NULL;
+
+    LockCursor cursor;
+    cursor_init(&cursor);
+    Tree* node = lock_target(&cursor, tree, path, path_end(path), LOCK_READ);
+    if (!node) return NULL;
+
+    char* result = children_string(node);
+    cursor_unlock(&cursor);
+    return result;
+}
+
+/* read_locks whole path, except for the last node, which is write_locked, adding the nodes
+   to the cursor. returns the node that the path points to
+   if such path doesn't exist, returns NULL and unlocks all nodes held by the cursor */
+static Tree* read_write_lock_path(LockCursor* cursor, Tree* tree, const char* path) {
+    return lock_path(cursor, tree, path, path_end(path), LOCK_WRITE);
 }
 
 int tree_create(Tree* tree, const char* path) {
     if (!is_path_valid(path)) return EINVAL;
     if (is_root(path)) return EEXIST;
 
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    char* path_to_parent = make_path_to_parent(path, component);
-    Tree* parent = read_write_lock_path(tree, path_to_parent);
-    free(path_to_parent);
+    const char* last = find_last_component(path);
+    const char* name = last + 1;
+    size_t length = path_end(path) - name;
+    LockCursor cursor;
+    cursor_init(&cursor);
+    Tree* parent = lock_target(&cursor, tree, path, last, LOCK_UPDATE);
     if (!parent) return ENOENT;
-    
-    if (hmap_get(parent->map, component)) {
-        write_unlock(parent);
-        if (parent->parent) read_unlock_predecessors(parent->parent);
+
+    Stripe* stripe = stripe_lock(parent, name, length);
+    HashMap* map = children_map(parent, name, length);
+    if (hmap_get_n(map, name, length)) {
+        stripe_unlock(stripe);
+        cursor_unlock(&cursor);
         return EEXIST;
     }
 
-    Tree* new = tree_new();
-    hmap_insert(parent->map, component, new);
-    new->parent = parent;
+    Tree* new = node_new(parent->policy);
+    size_t* version = children_version(parent, name, length);
+    version_begin(version);
+    CHECK_INSERT(hmap_insert_n(map, name, length, new));
+    version_end(version);
+    stripe_unlock(stripe);
 
-    write_unlock(parent);
-    if (parent->parent) read_unlock_predecessors(parent->parent);
+    if (cursor.exclusive) stripe_if_big(parent);
+    cursor_unlock(&cursor);
     return SUCCESS;
 }
 
+/* unlocks all nodes held by the cursor, and then unstripes parent, the last of them, if it has
+   few children left. parent is only read_locked if it is striped, and unstriping it needs
+   a write_lock. the root, which never gets removed, is waited for. other nodes may get removed
+   once they are unlocked, so they are only tried in an epoch critical section: if that fails,
+   a later removal tries again */
+static void unlock_and_unstripe(LockCursor* cursor, Tree* parent) {
+    if (parent->is_root) {
+        cursor_unlock(cursor);
+        write_lock(parent);
+        unstripe_if_small(parent);
+        write_unlock(parent);
+        return;
+    }
+    epoch_enter();
+    cursor_unlock(cursor);
+    if (write_trylock(parent)) {
+        if (!parent->removed) unstripe_if_small(parent);
+        write_unlock(parent);
+    }
+    epoch_exit();
+}
+
 int tree_remove(Tree* tree, const char* path) {
     if (!is_path_valid(path)) return EINVAL;
 
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    char* path_to_parent = make_path_to_parent(path, component);
-    if (!path_to_parent) return EBUSY;
-    Tree* parent = read_write_lock_path(tree, path_to_parent);
-    free(path_to_parent);
+    const char* last = find_last_component(path);
+    if (!last) return EBUSY;
+    const char* name = last + 1;
+    size_t length = path_end(path) - name;
+    LockCursor cursor;
+    cursor_init(&cursor);
+    Tree* parent = lock_target(&cursor, tree, path, last, LOCK_UPDATE);
     if (!parent) return ENOENT;
 
-    Tree* node = hmap_get(parent->map, component);
+    /* holding the stripe keeps other processes from entering node, see lock_subpath */
+    Stripe* stripe = stripe_lock(parent, name, length);
+    HashMap* map = children_map(parent, name, length);
+    Tree* node = hmap_get_n(map, name, length);
     if (!node) {
-        write_unlock(parent);
-        if (parent->parent) read_unlock_predecessors(parent->parent);
+        stripe_unlock(stripe);
+        cursor_unlock(&cursor);
         return ENOENT;
     }
 
-    subtree_wait(node);
-    if (hmap_size(node->map)) {
-        write_unlock(parent);
-        if (parent->parent) read_unlock_predecessors(parent->parent);
+    /* the folder is empty, so only processes working on node itself can hold it up,
+       and only while they hold its lock. the lock keeps new children from appearing */
+    write_lock(node);
+    if (children_count(node)) {
+        write_unlock(node);
+        stripe_unlock(stripe);
+        cursor_unlock(&cursor);
         return ENOTEMPTY;
     }
 
-    hmap_remove(parent->map, component);
-    tree_free(node);
-
-    write_unlock(parent);
-    if (parent->parent) read_unlock_predecessors(parent->parent);
+    /* the new version keeps optimistic processes from locking node from now on */
+    size_t* version = children_version(parent, name, length);
+    version_begin(version);
+    hmap_remove_n(map, name, length);
+    version_end(version);
+    node->removed = true;
+    write_unlock(node);
+    /* optimistic descents may still be looking at node */
+    epoch_retire(node, retired_node_free);
+
+    /* a stripe left with at most its share of UNSTRIPE_THRESHOLD children hints that parent
+       may have got small */
+    bool few_left = stripe && hmap_size(map) * N_STRIPES <= UNSTRIPE_THRESHOLD;
+    stripe_unlock(stripe);
+    if (few_left) unlock_and_unstripe(&cursor, parent);
+    else cursor_unlock(&cursor);
 
     return SUCCESS;
 }
@@ -307,44 +1185,29 @@ static char* rest_path(const char* path, const char* successor_path) {
     return result;
 }
 
-/* read_unlocks the tree and all its predecessors */
-static void read_unlock_predecessors_until_root(Tree* tree, Tree* root) {
-    if (tree == root) return;
-    read_unlock(tree);
-    if (tree->parent) read_unlock_predecessors_until_root(tree->parent, root);
+/* read_locks whole path below the locked root, except for the last node, which is
+   write_locked, adding the nodes to the cursor. returns the node that the path points to
+   if such path doesn't exist, returns NULL and unlocks all nodes held by the cursor */
+static Tree* read_write_lock_path_root_excluding(LockCursor* cursor, Tree* root, const char* path) {
+    return lock_subpath(cursor, root, path, path_end(path), LOCK_WRITE);
 }
 
-/* read_locks whole path, except for the root and last node, which is write_locked
-   returns the node that the path points to
-   if such path doesn't exist, returns NULL and rollbacks all read_locks */
-static Tree* read_write_lock_path_root_excluding(Tree* tree, const char* path, Tree* root) {
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    const char* subpath = path;
-    subpath = split_path(subpath, component);
-
-    if (tree != root) {
-        if (!subpath) {
-            write_lock(tree);
-            return tree;
-        }
-        read_lock(tree);
-    }
-
-    Tree* subtree = (Tree*) hmap_get(tree->map, component);
-    if (!subtree) {
-        read_unlock_predecessors_until_root(tree, root);
-        return NULL;
-    }
-    return read_write_lock_path_root_excluding(subtree, subpath, root);
+/* unlocks the nodes locked by tree_move: the paths to both parents and to their
+   lowest common ancestor */
+static void move_unlock(LockCursor* lcp_cursor, LockCursor* source_cursor, LockCursor* target_cursor) {
+    cursor_unlock(source_cursor);
+    cursor_unlock(target_cursor);
+    cursor_unlock(lcp_cursor);
 }
 
 /* finds path to the last common predecessor of two paths
    e.g. path1 = "/a/b/c/d/", path2 = "/a/b/e/" then the result is "/a/b/" */
 static char* find_last_common_predecessor(const char* path1, const char* path2) {
-    size_t len1 = strlen(path1), len2 = strlen(path2);
-    size_t len = len1 < len2 ? len1 : len2;
+    /* only whole components count: "/ab/" and "/ac/" have just "/" in common */
     size_t cnt = 0;
-    while (path1[cnt] == path2[cnt] && cnt < len) cnt++;
+    for (size_t i = 0; path1[i] && path1[i] == path2[i]; i++) {
+        if (path1[i] == '/') cnt = i + 1;
+    }
     char* res = malloc(cnt + 1);
     CHECK_PTR(res);
     memcpy(res, path1, cnt);
@@ -352,38 +1215,127 @@ static char* find_last_common_predecessor(const char* path1, const char* path2)
     return res;
 }
 
-int tree_move(Tree* tree, const char* source, const char* target) {
-    if (!is_path_valid(source) || !is_path_valid(target)) return EINVAL;
-
-    // if source == "/"
-    if (is_root(source)) return EBUSY;
+/* moves source_node, the child of source_parent with the given name, to target_parent
+   under the given name. both parents have to be write_locked and the move begun by move_begin */
+static void relink(Tree* source_parent, const char* source_name, size_t source_length,
+                   Tree* target_parent, const char* target_name, size_t target_length, Tree* source_node) {
+    /* processes working inside source_node go on: the node stays the same wherever it is.
+       descents that pass through it notice the move by the versions or its moves */
+    size_t* source_version = children_version(source_parent, source_name, source_length);
+    version_begin(source_version);
+    size_t* target_version = children_version(target_parent, target_name, target_length);
+    if (target_version != source_version) version_begin(target_version);
+    /* the node is inserted before it is removed, so that no map ever loses the subtree */
+    CHECK_INSERT(hmap_insert_n(children_map(target_parent, target_name, target_length), target_name, target_length, source_node));
+    hmap_remove_n(children_map(source_parent, source_name, source_length), source_name, source_length);
+    if (target_version != source_version) version_end(target_version);
+    version_end(source_version);
+}
 
-    // if target == "/"
-    if (is_root(target)) return EEXIST;
+/* number of moves tried by write_locking just the two parents, before falling back
+   to write_locking their lowest common ancestor */
+#define MOVE_TRIES 4
+
+/* returns if the part of path up to end leads to no node at some moment during the call */
+static bool path_missing(Tree* tree, const char* path, const char* end) {
+    LockCursor cursor;
+    cursor_init(&cursor);
+    if (!lock_target(&cursor, tree, path, end, LOCK_READ)) return true;
+    cursor_unlock(&cursor);
+    return false;
+}
 
-    // if target is successor of source
-    if (is_successor(source, target)) return ESUCCESSOR;
+/* moves source to target, checked by tree_move, by write_locking only their parents, see above
+   returns what tree_move returns, or sets *conflict if the move has to be retried
+   attempt alternates the parent that gets waited for */
+static int move_between_parents(Tree* tree, const char* source, const char* target, size_t attempt, bool* conflict) {
+    const char* source_last = find_last_component(source);
+    const char* source_name = source_last + 1;
+    size_t source_length = path_end(source) - source_name;
+    const char* target_last = find_last_component(target);
+    const char* target_name = target_last + 1;
+    size_t target_length = path_end(target) - target_name;
+
+    /* the first parent is waited for, the other one only tried: a move that isn't ordered yet
+       may put either parent under the other one, so no order of waiting is safe
+       the root is always the first one, because only it can't be tried */
+    bool target_first = attempt % 2;
+    if (target_last == target) target_first = true;
+    if (source_last == source) target_first = false;
+    const char* first_path = target_first ? target : source;
+    const char* first_end = target_first ? target_last : source_last;
+    const char* second_path = target_first ? source : target;
+    const char* second_end = target_first ? source_last : target_last;
+
+    /* the wait happens before the epoch critical section, which mustn't block */
+    LockCursor cursor;
+    cursor_init(&cursor);
+    Tree* first = lock_target(&cursor, tree, first_path, first_end, LOCK_WRITE);
+    *conflict = false;
+    if (!first) return ENOENT;
+    *conflict = true;
+
+    epoch_enter();
+    StepList steps;
+    steps_init(&steps);
+    Tree* second = NULL;
+    bool searched = optimistic_find(tree, first_path, first_end, &steps) == first;
+    if (searched) second = optimistic_find(tree, second_path, second_end, &steps);
+    bool locked = second && (second == first || write_trylock(second));
+    /* a removed parent is out of the tree */
+    if (locked && second->removed) {
+        if (second != first) write_unlock(second);
+        locked = false;
+    }
 
-    // important case
-    if (!strcmp(source, target)) {
-        Tree* source_node = read_lock_path(tree, source); // do we need to read_write lock it?
-        if (source_node) {
-            read_unlock_predecessors(source_node);
-            return SUCCESS;
+    Tree* source_parent = target_first ? second : first;
+    Tree* target_parent = target_first ? first : second;
+    Tree* source_node = NULL;
+    int result = SUCCESS;
+    if (locked) {
+        source_node = hmap_get_n(children_map(source_parent, source_name, source_length), source_name, source_length);
+        if (!source_node) result = ENOENT;
+        else if (hmap_get_n(children_map(target_parent, target_name, target_length), target_name, target_length)) result = EEXIST;
+        else move_begin(source_node);
+
+        /* if no node on the paths got moved since they were found, they still lead to the parents
+           the move is begun before that is checked: of two moves that could make a cycle
+           together, each of them moves a node on the other one's path, so at least one of them
+           sees the other one and backs off */
+        if (!steps_validate(&steps)) {
+            if (result == SUCCESS) move_end(source_node);
+            if (second != first) write_unlock(second);
+            locked = false;
         }
-        else return ENOENT;
     }
-
-    // important case
-    if (is_successor(target, source)) {
-        Tree* source_node = read_lock_path(tree, source); // do we need to read_write lock it?
-        if (source_node) {
-            read_unlock_predecessors(source_node);
-            return EEXIST;
+    /* from now on the parents are kept by their locks */
+    epoch_exit();
+    steps_free(&steps);
+    if (!locked) {
+        cursor_unlock(&cursor);
+        /* a parent that wasn't found may just not exist, which makes the move fail anyway */
+        if (searched && !second && path_missing(tree, second_path, second_end)) {
+            *conflict = false;
+            return ENOENT;
         }
-        else return ENOENT;
+        return SUCCESS;
+    }
+    *conflict = false;
+
+    if (result == SUCCESS) {
+        relink(source_parent, source_name, source_length, target_parent, target_name, target_length, source_node);
+        move_end(source_node);
+        stripe_if_big(target_parent);
+        unstripe_if_small(source_parent);
     }
+    if (second != first) write_unlock(second);
+    cursor_unlock(&cursor);
+    return result;
+}
 
+/* moves source to target, checked by tree_move, by write_locking the lowest common ancestor
+   of their parents and then both parents, keeping the paths to them read_locked */
+static int move_under_ancestor(Tree* tree, const char* source, const char* target) {
     char source_name[MAX_FOLDER_NAME_LENGTH + 1];
     char* path_to_source_parent = make_path_to_parent(source, source_name);
     if (!path_to_source_parent) return EBUSY;
@@ -394,7 +1346,11 @@ int tree_move(Tree* tree, const char* source, const char* target) {
 
     // find lcp
     char* lcp_path = find_last_common_predecessor(path_to_source_parent, path_to_target_parent);
-    Tree* lcp = read_write_lock_path(tree, lcp_path);
+    LockCursor lcp_cursor, source_cursor, target_cursor;
+    cursor_init(&lcp_cursor);
+    cursor_init(&source_cursor);
+    cursor_init(&target_cursor);
+    Tree* lcp = read_write_lock_path(&lcp_cursor, tree, lcp_path);
     if (!lcp) {
         free(path_to_source_parent);
         free(path_to_target_parent);
@@ -404,92 +1360,210 @@ int tree_move(Tree* tree, const char* source, const char* target) {
 
     // find source_parent
     char* lcp_to_source_parent = rest_path(lcp_path, path_to_source_parent);
-    Tree* source_parent = strlen(lcp_to_source_parent) > 1 ? read_write_lock_path_root_excluding(lcp, lcp_to_source_parent, lcp) : lcp;
+    Tree* source_parent = strlen(lcp_to_source_parent) > 1 ? read_write_lock_path_root_excluding(&source_cursor, lcp, lcp_to_source_parent) : lcp;
 
     free(lcp_to_source_parent);
     free(path_to_source_parent);
     if (!source_parent) {
         free(path_to_target_parent);
         free(lcp_path);
-        write_unlock(lcp);
-        if (lcp->parent) read_unlock_predecessors(lcp->parent);
+        move_unlock(&lcp_cursor, &source_cursor, &target_cursor);
         return ENOENT;
     }
 
     // find source_node
-    Tree* source_node = hmap_get(source_parent->map, source_name);
+    Tree* source_node = hmap_get(children_map(source_parent, source_name, strlen(source_name)), source_name);
     if (!source_node) {
         free(path_to_target_parent);
         free(lcp_path);
-        if (source_parent != lcp) {
-            write_unlock(source_parent);
-            if (source_parent->parent) read_unlock_predecessors_until_root(source_parent->parent, lcp);
-        }
-        write_unlock(lcp);
-        if (lcp->parent) read_unlock_predecessors(lcp->parent);
+        move_unlock(&lcp_cursor, &source_cursor, &target_cursor);
         return ENOENT;
     }
-    subtree_wait(source_node);
 
     // if source and target are the same
     if (!strcmp(source, target)) {
         free(lcp_path);
-        if (source_parent != lcp) {
-            write_unlock(source_parent);
-            if (source_parent->parent) read_unlock_predecessors_until_root(source_parent->parent, lcp);
-        }
-        write_unlock(lcp);
-        if (lcp->parent) read_unlock_predecessors(lcp->parent);
+        move_unlock(&lcp_cursor, &source_cursor, &target_cursor);
         return SUCCESS;
     }
     
     // find target parent
     char* lcp_to_target_parent = rest_path(lcp_path, path_to_target_parent);
-    Tree* target_parent = strlen(lcp_to_target_parent) > 1 ? read_write_lock_path_root_excluding(lcp, lcp_to_target_parent, lcp) : lcp;
+    Tree* target_parent = strlen(lcp_to_target_parent) > 1 ? read_write_lock_path_root_excluding(&target_cursor, lcp, lcp_to_target_parent) : lcp;
     
     free(lcp_path);
     free(lcp_to_target_parent);
     free(path_to_target_parent);
     if (!target_parent) {
-        if (source_parent != lcp) {
-            write_unlock(source_parent);
-            if (source_parent->parent) read_unlock_predecessors_until_root(source_parent->parent, lcp);
-        }
-        write_unlock(lcp);
-        if (lcp->parent) read_unlock_predecessors(lcp->parent);
+        move_unlock(&lcp_cursor, &source_cursor, &target_cursor);
         return ENOENT;
     }
 
     // check if target already exists
-    if (hmap_get(target_parent->map, target_name)) {
-        if (source_parent != lcp) {
-            write_unlock(source_parent);
-            if (source_parent->parent) read_unlock_predecessors_until_root(source_parent->parent, lcp);
-        }
-        if (target_parent != lcp) {
-            write_unlock(target_parent);
-            if (target_parent->parent) read_unlock_predecessors_until_root(target_parent->parent, lcp);
-        }
-        write_unlock(lcp);
-        if (lcp->parent) read_unlock_predecessors(lcp->parent);
+    if (hmap_get(children_map(target_parent, target_name, strlen(target_name)), target_name)) {
+        move_unlock(&lcp_cursor, &source_cursor, &target_cursor);
         return EEXIST;
     }
 
     // we're good to go
-    hmap_remove(source_parent->map, source_name);
-    hmap_insert(target_parent->map, target_name, source_node);
-    source_node->parent = target_parent;
+    move_begin(source_node);
+    relink(source_parent, source_name, strlen(source_name), target_parent, target_name, strlen(target_name), source_node);
+    move_end(source_node);
+    stripe_if_big(target_parent);
+    unstripe_if_small(source_parent);
 
-    if (source_parent != lcp) {
-        write_unlock(source_parent);
-        if (source_parent->parent) read_unlock_predecessors_until_root(source_parent->parent, lcp);
+    move_unlock(&lcp_cursor, &source_cursor, &target_cursor);
+
+    return SUCCESS;
+}
+
+int tree_move(Tree* tree, const char* source, const char* target) {
+    if (!is_path_valid(source) || !is_path_valid(target)) return EINVAL;
+
+    // if source == "/"
+    if (is_root(source)) return EBUSY;
+
+    // if target == "/"
+    if (is_root(target)) return EEXIST;
+
+    // if target is successor of source
+    if (is_successor(source, target)) return ESUCCESSOR;
+
+    // important case
+    if (!strcmp(source, target)) {
+        LockCursor cursor;
+        cursor_init(&cursor);
+        Tree* source_node = read_lock_path(&cursor, tree, source); // do we need to read_write lock it?
+        if (source_node) {
+            cursor_unlock(&cursor);
+            return SUCCESS;
+        }
+        else return ENOENT;
     }
-    if (target_parent != lcp) {
-        write_unlock(target_parent);
-        if (target_parent->parent) read_unlock_predecessors_until_root(target_parent->parent, lcp);
+
+    // important case
+    if (is_successor(target, source)) {
+        LockCursor cursor;
+        cursor_init(&cursor);
+        Tree* source_node = read_lock_path(&cursor, tree, source); // do we need to read_write lock it?
+        if (source_node) {
+            cursor_unlock(&cursor);
+            return EEXIST;
+        }
+        else return ENOENT;
     }
-    write_unlock(lcp);
-    if (lcp->parent) read_unlock_predecessors(lcp->parent);
 
-    return SUCCESS;
-}
\ No newline at end of file
+    for (size_t i = 0; i < MOVE_TRIES; i++) {
+        bool conflict;
+        int result = move_between_parents(tree, source, target, i, &conflict);
+        if (!conflict) return result;
+    }
+    return move_under_ancestor(tree, source, target);
+}
+
+/* adds the statistics of a map of children to stats */
+static void add_map_stats(HashMapStats* stats, HashMap* map) {
+    HashMapStats map_stats = hmap_stats(map);
+    stats->size += map_stats.size;
+    stats->capacity += map_stats.capacity;
+    stats->tombstones += map_stats.tombstones;
+    stats->bytes += map_stats.bytes;
+    for (size_t i = 0; i < HMAP_PROBE_HISTOGRAM_SIZE; i++) stats->probe_histogram[i] += map_stats.probe_histogram[i];
+    if (map_stats.max_probe > stats->max_probe) stats->max_probe = map_stats.max_probe;
+}
+
+/* paths of the folders that tree_stats has yet to visit, one after another in one buffer,
+   each of them followed by '\0' */
+typedef struct PathStack {
+    char* paths;
+    size_t length, capacity;
+} PathStack;
+
+/* pushes the path of the child with the given name of the folder with the given path */
+static void path_stack_push(PathStack* stack, const char* path, const char* name) {
+    size_t path_length = strlen(path), name_length = strlen(name);
+    size_t length = stack->length + path_length + name_length + 2;
+    if (length > stack->capacity) {
+        stack->capacity = 2 * length;
+        stack->paths = realloc(stack->paths, stack->capacity);
+        CHECK_PTR(stack->paths);
+    }
+    char* top = stack->paths + stack->length;
+    memcpy(top, path, path_length);
+    memcpy(top + path_length, name, name_length);
+    top[path_length + name_length] = '/';
+    top[path_length + name_length + 1] = '\0';
+    stack->length = length;
+}
+
+/* pops the last path pushed into *path, which has *capacity bytes and is reallocated if
+   they are too few, returns false if the stack is empty */
+static bool path_stack_pop(PathStack* stack, char** path, size_t* capacity) {
+    if (!stack->length) return false;
+    size_t start = stack->length - 1;
+    while (start && stack->paths[start - 1]) start--;
+    size_t length = stack->length - start;
+    if (length > *capacity) {
+        *capacity = 2 * length;
+        free(*path);
+        *path = malloc(*capacity);
+        CHECK_PTR(*path);
+    }
+    memcpy(*path, stack->paths + start, length);
+    stack->length = start;
+    return true;
+}
+
+/* adds the statistics of the read_locked node with the given path to stats, not counting
+   its subtree, and pushes the paths of its children to the stack */
+static void node_stats(Tree* tree, const char* path, TreeStats* stats, PathStack* stack) {
+    HashMap* maps[N_STRIPES];
+    size_t n_maps = children_maps(tree, maps);
+    if (tree->stripes) {
+        stats->n_striped++;
+        for (size_t i = 0; i < N_STRIPES; i++) CHECK_SYS_OP(pthread_mutex_lock(&tree->stripes[i].mutex), "mutex lock");
+    }
+
+    size_t fanout = children_count(tree), bucket = 0;
+    while (bucket < TREE_FANOUT_HISTOGRAM_SIZE - 1 && fanout >> bucket) bucket++;
+    stats->n_folders++;
+    stats->fanout_histogram[bucket]++;
+    if (fanout > stats->max_fanout) stats->max_fanout = fanout;
+
+    for (size_t i = 0; i < n_maps; i++) {
+        add_map_stats(&stats->maps, maps[i]);
+
+        const char* key = NULL;
+        void* value = NULL;
+        HashMapIterator it = hmap_iterator(maps[i]);
+        while (hmap_next(maps[i], &it, &key, &value)) path_stack_push(stack, path, key);
+    }
+
+    if (tree->stripes) {
+        for (size_t i = 0; i < N_STRIPES; i++) CHECK_SYS_OP(pthread_mutex_unlock(&tree->stripes[i].mutex), "mutex unlock");
+    }
+}
+
+/* the walk holds one folder at a time: it finds each of them by its path like tree_list
+   does, so that a writer anywhere waits for one folder's statistics at most */
+TreeStats tree_stats(Tree* tree) {
+    TreeStats stats;
+    memset(&stats, 0, sizeof(stats));
+    PathStack stack = { NULL, 0, 0 };
+    path_stack_push(&stack, "", "");
+    char* path = NULL;
+    size_t capacity = 0;
+    while (path_stack_pop(&stack, &path, &capacity)) {
+        LockCursor cursor;
+        cursor_init(&cursor);
+        /* a folder removed or moved away since its parent was visited is skipped */
+        Tree* node = lock_target(&cursor, tree, path, path_end(path), LOCK_READ);
+        if (!node) continue;
+        node_stats(node, path, &stats, &stack);
+        cursor_unlock(&cursor);
+    }
+    free(path);
+    free(stack.paths);
+    stats.root_write_locks = __atomic_load_n(&header_of(tree)->root_write_locks, __ATOMIC_RELAXED);
+    return stats;
+}
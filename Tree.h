@@ -15,6 +15,31 @@ typedef struct Tree Tree; // Let "Tree" mean the same as "struct Tree".
    returns a pointer to the new tree */
 Tree* tree_new();
 
+/* the order in which processes waiting for a folder get it, see tree_new_with_policy
+   readers are tree_list and the operations passing through a folder, writers are those
+   that change its subfolders */
+typedef enum TreeLockPolicy {
+    /* readers get in whenever no writer is in. they never wait for more than one writer,
+       but a steady stream of them can keep writers waiting for arbitrarily long */
+    TREE_READER_PREFERENCE,
+
+    /* readers wait while a writer waits, and a writer hands the folder over to the other
+       waiting writers before the readers. a burst of writers never waits for readers that
+       came after it, but readers wait for the whole burst, for arbitrarily long */
+    TREE_WRITER_PREFERENCE,
+
+    /* readers wait while a writer waits, and a writer lets in all readers that wait before
+       the next writer. a reader waits for at most one writer, and a writer waits for at most
+       one batch of readers between writers, so that nobody waits for arbitrarily long
+       because of the other kind. the default */
+    TREE_PHASE_FAIR
+} TreeLockPolicy;
+
+/* creates new tree with just one empty folder "/", whose folders are locked with
+   the given policy. returns a pointer to the new tree */
+Tree* tree_new_with_policy(TreeLockPolicy policy);
+
+
 /* frees all the memory related to this tree's subtree (this tree including) */
 void tree_free(Tree*);
 
@@ -46,3 +71,34 @@ int tree_remove(Tree* tree, const char* path);
    returns EBUSY if source path points to the root
    returns SUCCESS otherwise */
 int tree_move(Tree* tree, const char* source, const char* target);
+
+/* number of buckets of the fanout histogram of TreeStats */
+#define TREE_FANOUT_HISTOGRAM_SIZE 24
+
+/* statistics about a whole tree, see tree_stats */
+typedef struct TreeStats {
+    /* number of folders, the root including */
+    size_t n_folders;
+
+    /* number of folders whose children got spread over several maps */
+    size_t n_striped;
+
+    /* number of times the root got write_locked since the tree was created: by creates and
+       removes of its subfolders before it got striped, and by moves that had to lock it */
+    size_t root_write_locks;
+
+    /* fanout_histogram[0] is the number of folders without subfolders, fanout_histogram[i]
+       the number of those with 2^(i - 1) to 2^i - 1 subfolders (the last bucket also counts
+       bigger folders) */
+    size_t fanout_histogram[TREE_FANOUT_HISTOGRAM_SIZE];
+    size_t max_fanout;
+
+    /* statistics of all maps of children added up (max_probe is the maximum over them) */
+    HashMapStats maps;
+} TreeStats;
+
+/* gathers statistics about all folders of the tree
+   it runs concurrently with other operations, read_locking one folder at a time, so folders
+   changed meanwhile may be counted as they were before or after the change, and folders
+   moved meanwhile may be missed or counted twice */
+TreeStats tree_stats(Tree* tree);
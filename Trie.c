@@ -0,0 +1,413 @@
+// An implementation of HashMap.h for keys made only of the letters 'a'-'z', like folder names
+// (see `is_path_valid`). Build it instead of HashMap.c with `cmake -DHASHMAP_TRIE=ON`.
+//
+// The map is a compressed trie. Every node stands for a prefix of some keys, and chains of
+// nodes with one child and no value are merged into a single node, so that a node's label
+// (the part of its prefix after its parent's) can be many letters long. Siblings start with
+// distinct letters, so a node finds its children through a 26-bit mask: the child starting
+// with letter c is nodes[popcount(mask & ((1 << c) - 1))]. Visiting the nodes depth-first,
+// children in letter order, yields the keys sorted, without any extra index.
+// Keys with other characters are never present: inserting them fails.
+//
+// Lookups may run concurrently with changes (see `hmap_get`). Labels never change, the
+// children of a node are replaced as a whole, and a child is linked only once it is set up.
+// What gets unlinked (nodes and their children) is retired, see epoch.h.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "HashMap.h"
+#include "epoch.h"
+
+typedef struct HashMapNode Node;
+
+typedef struct Children Children;
+
+// The children of a node, which a lookup reads together with their mask.
+struct Children {
+    uint32_t mask; // Bit c is set iff some child's label starts with letter 'a' + c.
+    Node* nodes[]; // popcount(mask) children, in the order of their letters.
+};
+
+struct HashMapNode {
+    void* value; // Value stored under the node's prefix, or NULL if it is not a key.
+    Node* parent; // NULL for the root.
+    Children* children; // NULL if the node has no children.
+    uint32_t length; // Length of the prefix.
+    char prefix[]; // The prefix, null-terminated, so that it can be handed out as a key.
+};
+
+// The map itself (struct HashMap) is laid out in HashMap.h, so that it can be embedded.
+// Its root is the node of the empty prefix, never merged away. An empty map has no nodes.
+
+static bool is_letter(char c)
+{
+    return c >= 'a' && c <= 'z';
+}
+
+static int letter(char c)
+{
+    return c - 'a';
+}
+
+static Node* node_new(const char* prefix, size_t length, Node* parent)
+{
+    Node* node = malloc(sizeof(Node) + length + 1);
+    if (!node)
+        return NULL;
+    node->value = NULL;
+    node->parent = parent;
+    node->children = NULL;
+    node->length = length;
+    memcpy(node->prefix, prefix, length);
+    node->prefix[length] = '\0';
+    return node;
+}
+
+static uint32_t children_mask(Children* children)
+{
+    return children ? children->mask : 0;
+}
+
+static size_t n_children(Node* node)
+{
+    return __builtin_popcount(children_mask(node->children));
+}
+
+// Return the position in `nodes` of the child starting with letter c, present or not.
+static size_t child_index(uint32_t mask, int c)
+{
+    return __builtin_popcount(mask & ((1u << c) - 1));
+}
+
+// Return the link to the child starting with letter c, or NULL if there is none.
+// Lookups may call this concurrently with changes.
+static Node** child_link(Node* node, int c)
+{
+    Children* children = __atomic_load_n(&node->children, __ATOMIC_ACQUIRE);
+    if (!(children_mask(children) & (1u << c)))
+        return NULL;
+    return &children->nodes[child_index(children->mask, c)];
+}
+
+// Return new children with the given mask, or NULL on allocation failure.
+static Children* children_new(uint32_t mask)
+{
+    Children* children = malloc(sizeof(Children) + __builtin_popcount(mask) * sizeof(Node*));
+    if (children)
+        children->mask = mask;
+    return children;
+}
+
+// Replace the children of the node with `children`, which may be NULL, retiring the old ones.
+static void set_children(Node* node, Children* children)
+{
+    Children* old = node->children;
+    __atomic_store_n(&node->children, children, __ATOMIC_RELEASE);
+    if (old)
+        epoch_retire(old, free);
+}
+
+// Return the letter that starts the label of a node other than the root.
+static int first_letter(Node* node)
+{
+    return letter(node->prefix[node->parent->length]);
+}
+
+// Add `child`, whose label starts with letter c. Returns false on allocation failure.
+static bool add_child(Node* node, int c, Node* child)
+{
+    uint32_t mask = children_mask(node->children);
+    size_t n = n_children(node), i = child_index(mask, c);
+    Children* children = children_new(mask | 1u << c);
+    if (!children)
+        return false;
+    if (n) {
+        memcpy(children->nodes, node->children->nodes, i * sizeof(Node*));
+        memcpy(children->nodes + i + 1, node->children->nodes + i, (n - i) * sizeof(Node*));
+    }
+    children->nodes[i] = child;
+    child->parent = node;
+    set_children(node, children);
+    return true;
+}
+
+// Unlink the child whose label starts with letter c (the child is not freed).
+// Returns false on allocation failure.
+static bool remove_child(Node* node, int c)
+{
+    uint32_t mask = node->children->mask & ~(1u << c);
+    size_t n = n_children(node), i = child_index(mask, c);
+    Children* children = NULL;
+    if (mask) {
+        children = children_new(mask);
+        if (!children)
+            return false;
+        memcpy(children->nodes, node->children->nodes, i * sizeof(Node*));
+        memcpy(children->nodes + i, node->children->nodes + i + 1, (n - i - 1) * sizeof(Node*));
+    }
+    set_children(node, children);
+    return true;
+}
+
+static void node_free(Node* node)
+{
+    for (size_t i = 0; i < n_children(node); ++i)
+        node_free(node->children->nodes[i]);
+    free(node->children);
+    free(node);
+}
+
+// Free a node retired by `hmap_remove_n`, and what is left below it.
+static void retired_node_free(void* node)
+{
+    node_free(node);
+}
+
+HashMap* hmap_new()
+{
+    HashMap* map = malloc(sizeof(HashMap));
+    if (!map)
+        return NULL;
+    hmap_init(map);
+    return map;
+}
+
+void hmap_init(HashMap* map)
+{
+    map->root = NULL;
+    map->size = 0;
+}
+
+void hmap_free(HashMap* map)
+{
+    hmap_destroy(map);
+    free(map);
+}
+
+void hmap_destroy(HashMap* map)
+{
+    if (map->root)
+        node_free(map->root);
+}
+
+// Return the node whose prefix is `key` of the given length, or NULL if there is none.
+static Node* trie_find(HashMap* map, const char* key, size_t length)
+{
+    Node* node = __atomic_load_n(&map->root, __ATOMIC_ACQUIRE);
+    if (!node)
+        return NULL;
+    while (node->length < length) {
+        if (!is_letter(key[node->length]))
+            return NULL;
+        Node** link = child_link(node, letter(key[node->length]));
+        if (!link)
+            return NULL;
+        Node* child = __atomic_load_n(link, __ATOMIC_ACQUIRE);
+        if (child->length > length
+            || memcmp(child->prefix + node->length, key + node->length, child->length - node->length))
+            return NULL;
+        node = child;
+    }
+    return node;
+}
+
+void* hmap_get(HashMap* map, const char* key)
+{
+    return hmap_get_n(map, key, strlen(key));
+}
+
+void* hmap_get_n(HashMap* map, const char* key, size_t length)
+{
+    Node* node = trie_find(map, key, length);
+    return node ? __atomic_load_n(&node->value, __ATOMIC_ACQUIRE) : NULL;
+}
+
+bool hmap_insert(HashMap* map, const char* key, void* value)
+{
+    return hmap_insert_n(map, key, strlen(key), value);
+}
+
+// A failed allocation can leave behind a split node with one child and no value.
+// That only costs memory: lookups do not rely on nodes being merged.
+bool hmap_insert_n(HashMap* map, const char* key, size_t length, void* value)
+{
+    if (!value)
+        return false;
+    for (size_t i = 0; i < length; ++i) {
+        if (!is_letter(key[i]))
+            return false;
+    }
+
+    if (!map->root) {
+        Node* root = node_new("", 0, NULL);
+        if (!root)
+            return false;
+        __atomic_store_n(&map->root, root, __ATOMIC_RELEASE);
+    }
+    Node* node = map->root;
+    while (node->length < length) {
+        int c = letter(key[node->length]);
+        Node** link = child_link(node, c);
+        if (!link) {
+            Node* leaf = node_new(key, length, node);
+            if (!leaf)
+                return false;
+            if (!add_child(node, c, leaf)) {
+                free(leaf);
+                return false;
+            }
+            node = leaf;
+            break;
+        }
+
+        Node* child = *link;
+        size_t common = node->length + 1; // The first letter is known to match.
+        size_t end = child->length < length ? child->length : length;
+        while (common < end && child->prefix[common] == key[common])
+            common++;
+        if (common < child->length) {
+            // The key leaves the child's label midway: split the label by putting a node
+            // for the common prefix in the child's place.
+            Node* middle = node_new(key, common, node);
+            if (!middle)
+                return false;
+            middle->children = children_new(1u << letter(child->prefix[common]));
+            if (!middle->children) {
+                free(middle);
+                return false;
+            }
+            middle->children->nodes[0] = child;
+            child->parent = middle;
+            __atomic_store_n(link, middle, __ATOMIC_RELEASE);
+            child = middle;
+        }
+        node = child;
+    }
+
+    if (node->value)
+        return false; // Already exists.
+    __atomic_store_n(&node->value, value, __ATOMIC_RELEASE);
+    map->size++;
+    return true;
+}
+
+// Remove a node that is no longer needed: one other than the root, without a value
+// and with at most one child, which takes its place. Then do the same for its parent.
+// A failed allocation leaves the node in place, which only costs memory.
+static void trie_compact(HashMap* map, Node* node)
+{
+    while (node != map->root && !node->value && n_children(node) <= 1) {
+        Node* parent = node->parent;
+        if (n_children(node) == 0) {
+            if (!remove_child(parent, first_letter(node)))
+                return;
+        } else {
+            Node* child = node->children->nodes[0];
+            child->parent = parent;
+            __atomic_store_n(child_link(parent, first_letter(node)), child, __ATOMIC_RELEASE);
+            epoch_retire(node->children, free);
+        }
+        epoch_retire(node, free);
+        node = parent;
+    }
+}
+
+bool hmap_remove(HashMap* map, const char* key)
+{
+    return hmap_remove_n(map, key, strlen(key));
+}
+
+bool hmap_remove_n(HashMap* map, const char* key, size_t length)
+{
+    Node* node = trie_find(map, key, length);
+    if (!node || !node->value)
+        return false;
+    __atomic_store_n(&node->value, NULL, __ATOMIC_RELAXED);
+    map->size--;
+    trie_compact(map, node);
+    if (!map->size) {
+        // Only the root is left (and maybe nodes that failed to be compacted), which an
+        // empty map does without.
+        Node* root = map->root;
+        __atomic_store_n(&map->root, NULL, __ATOMIC_RELAXED);
+        epoch_retire(root, retired_node_free);
+    }
+    return true;
+}
+
+size_t hmap_size(HashMap* map)
+{
+    return map->size;
+}
+
+// Add the statistics of the subtree of `node`, `depth` nodes below the root, to `stats`.
+static void node_stats(Node* node, size_t depth, HashMapStats* stats)
+{
+    stats->capacity++;
+    stats->bytes += sizeof(Node) + node->length + 1;
+    if (node->children)
+        stats->bytes += sizeof(Children) + n_children(node) * sizeof(Node*);
+    if (node->value) {
+        // A lookup looks at the nodes on the way, the root's key counting as one step too.
+        size_t probe = depth ? depth : 1;
+        size_t bucket = probe < HMAP_PROBE_HISTOGRAM_SIZE ? probe : HMAP_PROBE_HISTOGRAM_SIZE;
+        stats->probe_histogram[bucket - 1]++;
+        if (probe > stats->max_probe)
+            stats->max_probe = probe;
+    }
+    for (size_t i = 0; i < n_children(node); ++i)
+        node_stats(node->children->nodes[i], depth + 1, stats);
+}
+
+HashMapStats hmap_stats(HashMap* map)
+{
+    HashMapStats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.size = map->size;
+    stats.bytes = sizeof(HashMap);
+    if (map->root)
+        node_stats(map->root, 0, &stats);
+    return stats;
+}
+
+// Return the node after `node` in depth-first order, or NULL if it is the last one.
+static Node* next_node(Node* node)
+{
+    if (node->children)
+        return node->children->nodes[0];
+    for (; node->parent; node = node->parent) {
+        Children* siblings = node->parent->children;
+        uint32_t later = siblings->mask & ~((2u << first_letter(node)) - 1);
+        if (later)
+            return siblings->nodes[child_index(siblings->mask, __builtin_ctz(later))];
+    }
+    return NULL;
+}
+
+// Return the first node holding a value from `node` on, in depth-first order.
+static Node* next_value(Node* node)
+{
+    while (node && !node->value)
+        node = next_node(node);
+    return node;
+}
+
+HashMapIterator hmap_iterator(HashMap* map)
+{
+    HashMapIterator it = { 0, map->root ? next_value(map->root) : NULL };
+    return it;
+}
+
+bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
+{
+    (void)map;
+    Node* node = it->entry;
+    if (!node)
+        return false;
+    *key = node->prefix;
+    *value = node->value;
+    it->entry = next_value(next_node(node));
+    return true;
+}
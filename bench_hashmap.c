@@ -0,0 +1,379 @@
+// Microbenchmarks for HashMap.
+// Build with optimizations, e.g. `cmake -DCMAKE_BUILD_TYPE=Release`, before trusting the numbers.
+//
+// Usage: bench_hashmap [max_size [max_threads]]
+// The map operations are timed for sizes 1, 10, ... up to max_size (default 10M, which needs
+// a few GB of memory) and 1, 2, 4, ... up to max_threads threads (default: number of CPUs).
+// Allocations are counted by wrapping malloc, calloc and realloc at link time
+// (-Wl,--wrap=malloc,... see CMakeLists.txt).
+
+#include "HashMap.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Number of distinct keys hashed per round.
+#define N_KEYS 4096
+
+// Total number of key bytes hashed per measurement, spread over rounds.
+#define BYTES_PER_RUN (256u << 20)
+
+// Minimum number of operations per measurement: small sizes are timed on many maps at once.
+#define MIN_OPS 1000000
+
+// Number of calls to malloc, calloc and realloc made by the current thread.
+static _Thread_local size_t n_allocs;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    n_allocs++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size)
+{
+    n_allocs++;
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* p, size_t size)
+{
+    n_allocs++;
+    return __real_realloc(p, size);
+}
+
+// The hash function HashMap used before hmap_hash: one multiply-add per byte, fixed seed.
+static unsigned int legacy_hash(const char* key)
+{
+    unsigned int hash = 17;
+    while (*key) {
+        hash = (hash << 3) + hash + *key;
+        ++key;
+    }
+    return hash;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Fill `keys` with N_KEYS random folder names of the given length.
+static char** make_keys(size_t length)
+{
+    char** keys = malloc(N_KEYS * sizeof(char*));
+    for (size_t i = 0; i < N_KEYS; ++i) {
+        keys[i] = malloc(length + 1);
+        for (size_t j = 0; j < length; ++j)
+            keys[i][j] = 'a' + rand() % 26;
+        keys[i][length] = '\0';
+    }
+    return keys;
+}
+
+static void free_keys(char** keys)
+{
+    for (size_t i = 0; i < N_KEYS; ++i)
+        free(keys[i]);
+    free(keys);
+}
+
+// Sink for hash values, so that the compiler cannot drop the loops.
+static volatile uint64_t sink;
+
+static void bench_hash(void)
+{
+    static const size_t lengths[] = { 1, 4, 8, 12, 16, 32, 64, 128, 255 };
+    printf("hash throughput (ns/hash, GB/s)\n");
+    printf("%8s %20s %20s\n", "length", "legacy get_hash", "hmap_hash");
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+        size_t length = lengths[l];
+        char** keys = make_keys(length);
+        size_t rounds = BYTES_PER_RUN / (length * N_KEYS) + 1;
+        double n_hashes = (double)rounds * N_KEYS;
+
+        uint64_t acc = 0;
+        double start = now_ns();
+        for (size_t r = 0; r < rounds; ++r)
+            for (size_t i = 0; i < N_KEYS; ++i)
+                acc += legacy_hash(keys[i]);
+        double legacy_ns = now_ns() - start;
+
+        start = now_ns();
+        for (size_t r = 0; r < rounds; ++r)
+            for (size_t i = 0; i < N_KEYS; ++i)
+                acc += hmap_hash(keys[i], strlen(keys[i]), r);
+        double wy_ns = now_ns() - start;
+        sink = acc;
+
+        printf("%8zu %11.2f %8.2f %11.2f %8.2f\n", length,
+            legacy_ns / n_hashes, n_hashes * length / legacy_ns,
+            wy_ns / n_hashes, n_hashes * length / wy_ns);
+        free_keys(keys);
+    }
+}
+
+// Lengths of the keys of a benchmark: from `min` to `max` with probability 1 - `long_share`,
+// otherwise from `long_min` to `long_max`.
+typedef struct KeyLengths {
+    const char* name;
+    size_t min, max;
+    double long_share;
+    size_t long_min, long_max;
+} KeyLengths;
+
+static const KeyLengths key_lengths[] = {
+    { "1-12", 1, 12, 0, 0, 0 }, // Short names, which HashMap packs into integers.
+    { "13-32", 13, 32, 0, 0, 0 },
+    { "mixed", 1, 12, 0.1, 13, 255 }, // Mostly short names and a few long ones.
+};
+
+// Fractions of lookups of keys that are in the map.
+static const double hit_ratios[] = { 1, 0.5, 0 };
+
+#define N_HIT_RATIOS (sizeof(hit_ratios) / sizeof(hit_ratios[0]))
+
+static uint64_t rng_next(uint64_t* state)
+{
+    // xorshift64*, much faster than rand() for generating millions of keys.
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dull;
+}
+
+static double rng_double(uint64_t* state)
+{
+    return (rng_next(state) >> 11) * (1.0 / (1ull << 53));
+}
+
+// Keys of a benchmark, all distinct: `size` keys inserted in the maps, as many absent ones,
+// and for every hit ratio a sequence of `size` keys to look up.
+typedef struct Keys {
+    size_t size;
+    char* buffer;
+    char** present;
+    char** absent;
+    char** lookups[N_HIT_RATIOS];
+} Keys;
+
+// Generate the keys. Each one ends with its index, written in a fixed number of letters,
+// which keeps them distinct; a length too short for that is extended.
+static Keys keys_new(size_t size, const KeyLengths* lengths, uint64_t* rng)
+{
+    Keys keys;
+    size_t n = 2 * size, width = 1;
+    for (size_t limit = 26; limit < n; limit *= 26)
+        width++;
+
+    size_t* key_length = malloc(n * sizeof(size_t));
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t min = lengths->min, max = lengths->max;
+        if (rng_double(rng) < lengths->long_share) {
+            min = lengths->long_min;
+            max = lengths->long_max;
+        }
+        size_t length = min + rng_next(rng) % (max - min + 1);
+        key_length[i] = length < width ? width : length;
+        total += key_length[i] + 1;
+    }
+
+    keys.size = size;
+    keys.buffer = malloc(total);
+    keys.present = malloc(n * sizeof(char*));
+    keys.absent = keys.present + size;
+    char* key = keys.buffer;
+    for (size_t i = 0; i < n; ++i) {
+        size_t length = key_length[i], index = i;
+        for (size_t j = 0; j < length - width; ++j)
+            key[j] = 'a' + rng_next(rng) % 26;
+        for (size_t j = length; j-- > length - width; index /= 26)
+            key[j] = 'a' + index % 26;
+        key[length] = '\0';
+        keys.present[i] = key;
+        key += length + 1;
+    }
+    free(key_length);
+
+    for (size_t r = 0; r < N_HIT_RATIOS; ++r) {
+        keys.lookups[r] = malloc(size * sizeof(char*));
+        for (size_t i = 0; i < size; ++i) {
+            char** from = rng_double(rng) < hit_ratios[r] ? keys.present : keys.absent;
+            keys.lookups[r][i] = from[rng_next(rng) % size];
+        }
+    }
+    return keys;
+}
+
+static void keys_free(Keys* keys)
+{
+    for (size_t r = 0; r < N_HIT_RATIOS; ++r)
+        free(keys->lookups[r]);
+    free(keys->present);
+    free(keys->buffer);
+}
+
+// The timed operations, in the order they are run.
+enum { OP_INSERT, OP_GET, OP_NEXT = OP_GET + N_HIT_RATIOS, OP_REMOVE, N_OPS };
+
+// State shared by the threads of a benchmark. Every thread works on its own maps, with the
+// same keys, like threads working in different folders.
+typedef struct Bench {
+    const Keys* keys;
+    size_t n_maps; // Maps per thread, so that each thread does at least MIN_OPS operations.
+    pthread_barrier_t barrier;
+    double ns[N_OPS]; // Time taken by all threads, measured by thread 0.
+    size_t allocs[N_OPS]; // Allocations made by all threads.
+    pthread_mutex_t mutex; // Protects `allocs`.
+} Bench;
+
+typedef struct Worker {
+    pthread_t thread;
+    size_t id;
+    Bench* bench;
+} Worker;
+
+// Wait for all threads and then start timing an operation.
+static void op_start(Worker* worker, double* start)
+{
+    pthread_barrier_wait(&worker->bench->barrier);
+    if (worker->id == 0)
+        *start = now_ns();
+    n_allocs = 0;
+}
+
+// Wait for all threads to finish operation `op` and record its time and allocations.
+static void op_end(Worker* worker, size_t op, double start)
+{
+    Bench* bench = worker->bench;
+    size_t allocs = n_allocs;
+    pthread_barrier_wait(&bench->barrier);
+    if (worker->id == 0)
+        bench->ns[op] = now_ns() - start;
+    pthread_mutex_lock(&bench->mutex);
+    bench->allocs[op] += allocs;
+    pthread_mutex_unlock(&bench->mutex);
+}
+
+static void* worker_run(void* arg)
+{
+    Worker* worker = arg;
+    Bench* bench = worker->bench;
+    const Keys* keys = bench->keys;
+    size_t n_maps = bench->n_maps, size = keys->size;
+    double start = 0;
+
+    HashMap** maps = malloc(n_maps * sizeof(HashMap*));
+    for (size_t m = 0; m < n_maps; ++m)
+        maps[m] = hmap_new();
+
+    op_start(worker, &start);
+    for (size_t m = 0; m < n_maps; ++m)
+        for (size_t i = 0; i < size; ++i)
+            hmap_insert(maps[m], keys->present[i], keys->present[i]);
+    op_end(worker, OP_INSERT, start);
+
+    uint64_t acc = 0;
+    for (size_t r = 0; r < N_HIT_RATIOS; ++r) {
+        op_start(worker, &start);
+        for (size_t m = 0; m < n_maps; ++m)
+            for (size_t i = 0; i < size; ++i)
+                acc += (uintptr_t)hmap_get(maps[m], keys->lookups[r][i]);
+        op_end(worker, OP_GET + r, start);
+    }
+
+    op_start(worker, &start);
+    for (size_t m = 0; m < n_maps; ++m) {
+        const char* key = NULL;
+        void* value = NULL;
+        HashMapIterator it = hmap_iterator(maps[m]);
+        while (hmap_next(maps[m], &it, &key, &value))
+            acc += (uintptr_t)value;
+    }
+    op_end(worker, OP_NEXT, start);
+
+    op_start(worker, &start);
+    for (size_t m = 0; m < n_maps; ++m)
+        for (size_t i = 0; i < size; ++i)
+            hmap_remove(maps[m], keys->present[i]);
+    op_end(worker, OP_REMOVE, start);
+
+    for (size_t m = 0; m < n_maps; ++m)
+        hmap_free(maps[m]);
+    free(maps);
+    sink = acc;
+    return NULL;
+}
+
+// Time all operations on maps of `keys->size` keys in `n_threads` threads and print a row.
+static void bench_ops_run(const Keys* keys, const char* lengths_name, size_t n_threads)
+{
+    Bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.keys = keys;
+    bench.n_maps = (MIN_OPS + keys->size - 1) / keys->size;
+    pthread_barrier_init(&bench.barrier, NULL, n_threads);
+    pthread_mutex_init(&bench.mutex, NULL);
+
+    Worker* workers = malloc(n_threads * sizeof(Worker));
+    for (size_t t = 0; t < n_threads; ++t) {
+        workers[t].id = t;
+        workers[t].bench = &bench;
+        if (t > 0)
+            pthread_create(&workers[t].thread, NULL, worker_run, &workers[t]);
+    }
+    worker_run(&workers[0]);
+    for (size_t t = 1; t < n_threads; ++t)
+        pthread_join(workers[t].thread, NULL);
+    free(workers);
+    pthread_mutex_destroy(&bench.mutex);
+    pthread_barrier_destroy(&bench.barrier);
+
+    // Times are per operation of one thread: equal times mean perfect scaling.
+    double ops_per_thread = (double)bench.n_maps * keys->size;
+    printf("%-6s %9zu %7zu", lengths_name, keys->size, n_threads);
+    for (size_t op = 0; op < N_OPS; ++op)
+        printf(" %7.1f %6.3f", bench.ns[op] / ops_per_thread, bench.allocs[op] / (ops_per_thread * n_threads));
+    printf("\n");
+    fflush(stdout);
+}
+
+static void bench_ops(size_t max_size, size_t max_threads)
+{
+    printf("\nmap operations (ns/op per thread, allocs/op)\n");
+    printf("%-6s %9s %7s %14s %14s %14s %14s %14s %14s\n", "keys", "size", "threads",
+        "insert", "get 100% hit", "get 50% hit", "get 0% hit", "next", "remove");
+    uint64_t rng = 1;
+    for (size_t l = 0; l < sizeof(key_lengths) / sizeof(key_lengths[0]); ++l) {
+        for (size_t size = 1; size <= max_size; size *= 10) {
+            Keys keys = keys_new(size, &key_lengths[l], &rng);
+            // Every thread gets its own maps: keep the total number of keys within max_size.
+            for (size_t n_threads = 1; n_threads <= max_threads && (n_threads == 1 || size * n_threads <= max_size); n_threads *= 2)
+                bench_ops_run(&keys, key_lengths[l].name, n_threads);
+            keys_free(&keys);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t max_size = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = argc > 2 ? strtoul(argv[2], NULL, 10) : (n_cpus > 0 ? n_cpus : 1);
+
+    srand(1);
+    bench_hash();
+    bench_ops(max_size, max_threads);
+    return 0;
+}
@@ -0,0 +1,222 @@
+// Epoch-based memory reclamation, see epoch.h.
+//
+// A global epoch counter only grows. A thread in a critical section publishes the epoch it
+// saw on entering, and the epoch advances from e to e + 1 only once every thread in a
+// critical section has seen e. Memory retired in epoch e was unreachable before the epoch
+// became e + 1, so once it is e + 2 no thread can be in a critical section from before
+// that: the memory can be freed. Each thread keeps its retired memory in N_LIMBO lists,
+// by epoch modulo N_LIMBO, and every RETIRE_BATCH retirements it tries to advance
+// the epoch and frees what has become safe.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "err.h"
+
+#define N_LIMBO 3
+
+// Number of retirements after which a thread tries to advance the epoch.
+#define RETIRE_BATCH 64
+
+// Size of a cache line, so that threads entering critical sections don't share them.
+#define CACHE_LINE 64
+
+typedef struct Retired Retired;
+
+struct Retired {
+    Retired* next;
+    void* p;
+    void (*free_fn)(void*);
+};
+
+typedef struct Record Record;
+
+// The state of a thread, reused by another thread once it exits.
+struct Record {
+    _Alignas(CACHE_LINE) size_t state; // (epoch << 1) | 1 inside a critical section, 0 outside.
+    size_t depth; // Nesting of critical sections.
+    size_t n_retired; // Retirements since the last attempt to advance the epoch.
+    bool in_use; // Whether a thread owns the record.
+    pthread_mutex_t mutex; // Protects the limbo lists, which epoch_barrier frees too.
+    Retired* limbo[N_LIMBO];
+    size_t limbo_epoch[N_LIMBO]; // Epoch in which the memory on each list was retired.
+    Record* next;
+};
+
+static size_t global_epoch = 0;
+
+// Records of all threads that ever entered a critical section or retired memory, never freed.
+static Record* records = NULL;
+
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+
+// Give the record of an exiting thread back. Its retired memory stays on it.
+static void record_release(void* record)
+{
+    __atomic_store_n(&((Record*)record)->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void record_key_create(void)
+{
+    if (pthread_key_create(&record_key, record_release))
+        syserr("Error in key create\n");
+}
+
+// Return the record of the calling thread.
+static Record* record_self(void)
+{
+    static _Thread_local Record* self = NULL;
+    if (self)
+        return self;
+
+    if (pthread_once(&record_once, record_key_create))
+        syserr("Error in once\n");
+    for (Record* record = __atomic_load_n(&records, __ATOMIC_ACQUIRE); record && !self; record = record->next) {
+        bool expected = false;
+        if (__atomic_compare_exchange_n(&record->in_use, &expected, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            self = record;
+    }
+    if (!self) {
+        self = aligned_alloc(CACHE_LINE, sizeof(Record));
+        if (!self)
+            syserr("Error in malloc\n");
+        self->state = 0;
+        self->depth = 0;
+        self->n_retired = 0;
+        self->in_use = true;
+        if (pthread_mutex_init(&self->mutex, NULL))
+            syserr("Error in mutex init\n");
+        for (size_t i = 0; i < N_LIMBO; ++i) {
+            self->limbo[i] = NULL;
+            self->limbo_epoch[i] = 0;
+        }
+        self->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &self->next, self, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            ;
+    }
+    if (pthread_setspecific(record_key, self))
+        syserr("Error in setspecific\n");
+    return self;
+}
+
+void epoch_enter(void)
+{
+    Record* self = record_self();
+    if (self->depth++)
+        return;
+    size_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->state, epoch << 1 | 1, __ATOMIC_SEQ_CST);
+    // Nothing read in the critical section may be read before the state is published.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void)
+{
+    Record* self = record_self();
+    if (--self->depth)
+        return;
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+}
+
+// Advance the epoch if every thread in a critical section has seen the current one.
+static void try_advance(void)
+{
+    size_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    for (Record* record = __atomic_load_n(&records, __ATOMIC_ACQUIRE); record; record = record->next) {
+        size_t state = __atomic_load_n(&record->state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && state >> 1 != epoch)
+            return;
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static void free_list(Retired* list)
+{
+    while (list) {
+        Retired* next = list->next;
+        list->free_fn(list->p);
+        free(list);
+        list = next;
+    }
+}
+
+// Unlink and return the memory of the record that can be freed. The record must be locked.
+static Retired* take_safe(Record* record)
+{
+    size_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    Retired* result = NULL;
+    for (size_t i = 0; i < N_LIMBO; ++i) {
+        if (!record->limbo[i] || record->limbo_epoch[i] + 2 > epoch)
+            continue;
+        Retired* last = record->limbo[i];
+        while (last->next)
+            last = last->next;
+        last->next = result;
+        result = record->limbo[i];
+        record->limbo[i] = NULL;
+    }
+    return result;
+}
+
+void epoch_retire(void* p, void (*free_fn)(void*))
+{
+    Record* self = record_self();
+    Retired* retired = malloc(sizeof(Retired));
+    if (!retired)
+        syserr("Error in malloc\n");
+    retired->p = p;
+    retired->free_fn = free_fn;
+
+    size_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    size_t i = epoch % N_LIMBO;
+    Retired* safe = NULL;
+    if (pthread_mutex_lock(&self->mutex))
+        syserr("Error in mutex lock\n");
+    if (self->limbo_epoch[i] != epoch) {
+        // The list holds memory retired at least N_LIMBO epochs ago.
+        safe = self->limbo[i];
+        self->limbo[i] = NULL;
+        self->limbo_epoch[i] = epoch;
+    }
+    retired->next = self->limbo[i];
+    self->limbo[i] = retired;
+    bool batch_full = ++self->n_retired >= RETIRE_BATCH;
+    if (batch_full)
+        self->n_retired = 0;
+    if (pthread_mutex_unlock(&self->mutex))
+        syserr("Error in mutex unlock\n");
+    free_list(safe);
+
+    if (batch_full) {
+        try_advance();
+        if (pthread_mutex_lock(&self->mutex))
+            syserr("Error in mutex lock\n");
+        safe = take_safe(self);
+        if (pthread_mutex_unlock(&self->mutex))
+            syserr("Error in mutex unlock\n");
+        free_list(safe);
+    }
+}
+
+void epoch_barrier(void)
+{
+    size_t target = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) + 2;
+    while (__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) < target) {
+        try_advance();
+        if (__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) < target)
+            sched_yield();
+    }
+
+    for (Record* record = __atomic_load_n(&records, __ATOMIC_ACQUIRE); record; record = record->next) {
+        if (pthread_mutex_lock(&record->mutex))
+            syserr("Error in mutex lock\n");
+        Retired* safe = take_safe(record);
+        if (pthread_mutex_unlock(&record->mutex))
+            syserr("Error in mutex unlock\n");
+        free_list(safe);
+    }
+}
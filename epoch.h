@@ -0,0 +1,23 @@
+#pragma once
+
+// Epoch-based memory reclamation.
+// Memory that concurrent readers may still be looking at after it got unlinked is retired
+// instead of freed. It is freed once every thread that might have seen it has left its
+// critical section, i.e. after a grace period.
+
+// Enter a critical section: nothing retired from now on is freed before the matching
+// epoch_exit. Critical sections can be nested. They should be short and must not block
+// on threads that wait for a grace period (see epoch_barrier).
+void epoch_enter(void);
+
+// Leave the critical section entered by the matching epoch_enter.
+void epoch_exit(void);
+
+// Call `free_fn(p)` once no critical section that may have seen `p` is left.
+// `p` must already be unreachable for threads entering a critical section.
+void epoch_retire(void* p, void (*free_fn)(void*));
+
+// Wait until every critical section entered before the call has been left, and free
+// everything retired before the call. Must not be called from inside a critical section.
+void epoch_barrier(void);
+
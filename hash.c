@@ -0,0 +1,79 @@
+// The hash function of HashMap.h, shared by its implementations.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "HashMap.h"
+
+// The hash is a variant of wyhash: 8 or 16 bytes are folded into the state per step,
+// each step being one 64x64->128 bit multiplication.
+// See https://github.com/wangyi-fudan/wyhash (public domain).
+
+static const uint64_t WY_P0 = 0xa0761d6478bd642full;
+static const uint64_t WY_P1 = 0xe7037ed1a0b428dbull;
+static const uint64_t WY_P2 = 0x8ebc6af09c88c6e3ull;
+static const uint64_t WY_P3 = 0x589965cc75374cc3ull;
+
+// Multiply and fold the 128-bit product.
+static uint64_t wymix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static uint64_t read64(const char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read32(const char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t hmap_hash(const char* key, size_t length, uint64_t seed)
+{
+    const char* p = key;
+    uint64_t a, b;
+    if (length <= 16) {
+        if (length >= 4) {
+            // Two possibly overlapping pairs of 4-byte reads cover the whole key.
+            size_t shift = (length >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + shift);
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - shift);
+        } else if (length > 0) {
+            a = ((uint64_t)(uint8_t)p[0] << 16) | ((uint64_t)(uint8_t)p[length >> 1] << 8)
+                | (uint8_t)p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = length;
+        if (i > 48) {
+            // Three independent lanes keep the multiplier busy on long keys.
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = wymix(read64(p) ^ WY_P1, read64(p + 8) ^ seed);
+                seed1 = wymix(read64(p + 16) ^ WY_P2, read64(p + 24) ^ seed1);
+                seed2 = wymix(read64(p + 32) ^ WY_P3, read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = wymix(read64(p) ^ WY_P1, read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    __uint128_t r = (__uint128_t)(a ^ WY_P1) * (b ^ seed);
+    return wymix((uint64_t)r ^ WY_P0 ^ length, (uint64_t)(r >> 64) ^ WY_P1);
+}
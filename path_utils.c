@@ -64,11 +64,15 @@ char* make_path_to_parent(const char* path, char* component)
     return result;
 }
 
-// A wrapper for using strcmp in qsort.
-// The arguments here are actually pointers to (const char*).
-static int compare_string_pointers(const void* p1, const void* p2)
+const char* find_last_component(const char* path)
 {
-    return strcmp(*(const char**)p1, *(const char**)p2);
+    size_t len = strlen(path);
+    if (len == 1) // Path is "/".
+        return NULL;
+    const char* p = path + len - 2; // Point before final '/' character.
+    while (*p != '/')
+        p--;
+    return p;
 }
 
 const char** make_map_contents_array(HashMap* map)
@@ -82,7 +86,7 @@ const char** make_map_contents_array(HashMap* map)
         key++;
     }
     *key = NULL; // Set last array element to NULL.
-    qsort(result, n_keys, sizeof(char*), compare_string_pointers);
+    // No sorting needed: the map iterates in key order.
     return result;
 }
 
@@ -118,3 +122,45 @@ char* make_map_contents_string(HashMap* map)
     free(keys);
     return result;
 }
+
+char* make_maps_contents_string(HashMap** maps, size_t n_maps)
+{
+    const char*** keys = malloc(n_maps * sizeof(const char**));
+    unsigned int result_size = 1; // Including ending null character.
+    for (size_t i = 0; i < n_maps; ++i) {
+        keys[i] = make_map_contents_array(maps[i]);
+        for (const char** key = keys[i]; *key; ++key)
+            result_size += strlen(*key) + 1;
+    }
+
+    char* result = malloc(result_size);
+    char* position = result;
+    // Every array is sorted, so repeatedly taking the smallest head yields all keys in order.
+    const char*** heads = malloc(n_maps * sizeof(const char**));
+    memcpy(heads, keys, n_maps * sizeof(const char**));
+    for (;;) {
+        const char*** min = NULL;
+        for (size_t i = 0; i < n_maps; ++i) {
+            if (*heads[i] && (!min || strcmp(*heads[i], **min) < 0))
+                min = &heads[i];
+        }
+        if (!min)
+            break;
+        size_t keylen = strlen(**min);
+        assert(position + keylen + 1 <= result + result_size);
+        memcpy(position, **min, keylen);
+        position += keylen;
+        *position = ',';
+        position++;
+        (*min)++;
+    }
+    if (position > result)
+        position--; // Drop the trailing comma.
+    *position = '\0';
+
+    for (size_t i = 0; i < n_maps; ++i)
+        free(keys[i]);
+    free(keys);
+    free(heads);
+    return result;
+}
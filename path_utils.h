@@ -41,6 +41,14 @@ const char* split_path(const char* path, char* component);
 // Otherwise the result is a valid path.
 char* make_path_to_parent(const char* path, char* component);
 
+// Return a pointer to the last-but-one '/' character of `path`, which starts the last
+// component, e.g. "/c/" for "/a/b/c/". Unlike `make_path_to_parent`, nothing is copied:
+// the path to the parent is the part of `path` up to and including the result.
+// Args:
+// - `path`: should be a valid path (see `is_path_valid`).
+// If path is "/", returns NULL.
+const char* find_last_component(const char* path);
+
 // Return an array containing all keys, lexicographically sorted.
 // The result is null-terminated.
 // Keys are not copied, they are only valid as long as the map.
@@ -51,3 +59,8 @@ const char** make_map_contents_array(HashMap* map);
 // The result has no trailing comma. An empty map yields an empty string.
 // The caller should free the result.
 char* make_map_contents_string(HashMap* map);
+
+// Return a string containing all keys of all the `n_maps` maps, sorted, comma-separated.
+// The maps should have no keys in common. Like for `make_map_contents_string`, the result
+// has no trailing comma, and should be free'd by the caller.
+char* make_maps_contents_string(HashMap** maps, size_t n_maps);
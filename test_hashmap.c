@@ -0,0 +1,206 @@
+// Test of HashMap.h: random inserts, lookups and removes checked against a reference, while
+// a map grows to a few thousand keys and shrinks back to empty, a few times over. That takes
+// HashMap.c through all its layouts (inline entries, a table with a sorted array and a table
+// with a skiplist) both ways. Built once for HashMap.c and once for Trie.c (HASHMAP_TRIE),
+// whose keys are restricted to the letters 'a'-'z'.
+
+#include "HashMap.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of distinct keys the operations pick from.
+#define N_KEYS 4096
+
+// A map grows to GROWN_SIZE keys, more than the 1024 slots up to which HashMap.c keeps
+// a sorted array, and then shrinks back to none, N_ROUNDS times.
+#define GROWN_SIZE 3000
+#define N_ROUNDS 3
+
+// The iteration order is checked every CHECK_PERIOD operations, and after each one
+// while the map is smaller than that.
+#define CHECK_PERIOD 64
+
+// Fail the test unless the condition holds.
+#define CHECK(condition) do { if (!(condition)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); exit(1); } } while (0)
+
+// The keys, sorted by strcmp, whether each of them is in the map, and what the map should
+// hold under it: the address of its own `values` element.
+static char* keys[N_KEYS];
+static bool present[N_KEYS];
+static int values[N_KEYS];
+static size_t size;
+
+// All keys, the `size` present ones first, and the position of each key there, so that
+// a random present or absent key can be picked.
+static size_t order[N_KEYS];
+static size_t position[N_KEYS];
+
+static int compare_keys(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Append `length` random characters to `key`. Keys of Trie.c take letters only, other keys
+// sometimes take other characters too, so that HashMap.c cannot pack them.
+static char* append_random(char* key, size_t length, unsigned* seed)
+{
+    bool letters = true;
+#ifndef HASHMAP_TRIE
+    letters = rand_r(seed) % 8;
+#endif
+    for (size_t i = 0; i < length; i++)
+        *key++ = letters ? 'a' + rand_r(seed) % 26 : '0' + rand_r(seed) % 43;
+    return key;
+}
+
+// Fill `keys` with distinct keys. Key 2i is three letters that encode i, and key 2i + 1 is
+// key 2i followed by some more characters, so that many keys are prefixes of other ones.
+// Most keys are short, like folder names, some are longer than HashMap.c can pack, and,
+// unless they are for Trie.c, a few are hundreds of characters long.
+static void make_keys(void)
+{
+    unsigned seed = 1;
+    for (size_t i = 0; i < N_KEYS; i++) {
+        size_t length = 0;
+        if (i % 2) {
+            length = 1 + rand_r(&seed) % 8;
+            if (rand_r(&seed) % 4 == 0)
+                length += 8 + rand_r(&seed) % 8;
+#ifndef HASHMAP_TRIE
+            if (rand_r(&seed) % 64 == 0)
+                length += 600;
+#endif
+        }
+        keys[i] = malloc(3 + length + 1);
+        CHECK(keys[i]);
+        for (size_t j = 0, n = i / 2; j < 3; j++, n /= 26)
+            keys[i][2 - j] = 'a' + n % 26;
+        *append_random(keys[i] + 3, length, &seed) = '\0';
+    }
+    qsort(keys, N_KEYS, sizeof(char*), compare_keys);
+    for (size_t i = 0; i < N_KEYS; i++)
+        order[i] = position[i] = i;
+}
+
+// Mark `key` as present or not, keeping `order` partitioned.
+static void set_present(size_t key, bool value)
+{
+    if (present[key] == value)
+        return;
+    size_t other = order[value ? size : size - 1];
+    order[position[key]] = other;
+    position[other] = position[key];
+    order[value ? size : size - 1] = key;
+    position[key] = value ? size : size - 1;
+    present[key] = value;
+    size += value ? 1 : -1;
+}
+
+// Return a random key, which is usually present if `want_present`, and usually absent otherwise.
+static size_t random_key(bool want_present, unsigned* seed)
+{
+    size_t n = want_present ? size : N_KEYS - size;
+    if (n == 0 || rand_r(seed) % 4 == 0)
+        return rand_r(seed) % N_KEYS;
+    return order[(want_present ? 0 : size) + rand_r(seed) % n];
+}
+
+// Check that the map holds what it should under `key`, looked up in place of a longer string.
+static void check_get(HashMap* map, size_t key)
+{
+    size_t length = strlen(keys[key]);
+    char buffer[length + 2];
+    memcpy(buffer, keys[key], length);
+    buffer[length] = 'a';
+    buffer[length + 1] = '\0';
+    void* expected = present[key] ? &values[key] : NULL;
+    CHECK(hmap_get_n(map, buffer, length) == expected);
+    CHECK(hmap_get(map, keys[key]) == expected);
+}
+
+// Check that the map holds exactly the present keys, visited in order.
+static void check_contents(HashMap* map)
+{
+    CHECK(hmap_size(map) == size);
+    CHECK(hmap_stats(map).size == size);
+    const char* key = NULL;
+    void* value = NULL;
+    HashMapIterator it = hmap_iterator(map);
+    for (size_t i = 0; i < N_KEYS; i++) {
+        if (!present[i])
+            continue;
+        CHECK(hmap_next(map, &it, &key, &value));
+        CHECK(!strcmp(key, keys[i]));
+        CHECK(value == &values[i]);
+    }
+    CHECK(!hmap_next(map, &it, &key, &value));
+}
+
+// Insert or remove a random key, inserting with probability `insert_percent` / 100, and check
+// the result and a few lookups.
+static void random_operation(HashMap* map, int insert_percent, unsigned* seed)
+{
+    bool insert = rand_r(seed) % 100 < insert_percent;
+    size_t key = random_key(!insert, seed);
+    if (insert) {
+        void* other = &values[(key + 1) % N_KEYS];
+        CHECK(hmap_insert(map, keys[key], present[key] ? other : &values[key]) == !present[key]);
+        set_present(key, true);
+    } else {
+        CHECK(hmap_remove_n(map, keys[key], strlen(keys[key])) == present[key]);
+        set_present(key, false);
+    }
+    check_get(map, key);
+    check_get(map, rand_r(seed) % N_KEYS);
+}
+
+int main(void)
+{
+    make_keys();
+    HashMap* map = hmap_new();
+    CHECK(map);
+    CHECK(!hmap_insert(map, keys[0], NULL));
+    check_contents(map);
+
+    unsigned seed = 1;
+    size_t n_operations = 0, max_capacity = 0;
+    for (int round = 0; round < N_ROUNDS; round++) {
+        while (size < GROWN_SIZE) {
+            random_operation(map, 75, &seed);
+            if (++n_operations % CHECK_PERIOD == 0 || size < CHECK_PERIOD)
+                check_contents(map);
+        }
+        HashMapStats stats = hmap_stats(map);
+        if (stats.capacity > max_capacity)
+            max_capacity = stats.capacity;
+
+        while (size > 0) {
+            // A map left with a few of its keys gives most of its memory back too.
+            if (size == GROWN_SIZE / 32)
+                CHECK(hmap_stats(map).bytes < 64 * 1024);
+            random_operation(map, 25, &seed);
+            if (++n_operations % CHECK_PERIOD == 0 || size < CHECK_PERIOD)
+                check_contents(map);
+        }
+        check_contents(map);
+
+        // An empty map gives its memory back.
+        stats = hmap_stats(map);
+        CHECK(stats.bytes < 1024);
+#ifndef HASHMAP_TRIE
+        CHECK(stats.capacity == 4);
+#endif
+    }
+#ifndef HASHMAP_TRIE
+    CHECK(max_capacity > 1024);
+#endif
+
+    hmap_free(map);
+    for (size_t i = 0; i < N_KEYS; i++)
+        free(keys[i]);
+    printf("%zu operations, up to %zu keys, %zu places at most\n", n_operations, (size_t)GROWN_SIZE, max_capacity);
+    return 0;
+}
@@ -0,0 +1,338 @@
+// Stress test of Tree.h: threads create, remove, move and list folders with random paths
+// over a small namespace, so that they keep running into each other, once for every lock
+// policy. In the end, walking the tree has to find exactly as many folders as successful
+// creates added and successful removes took away. Then threads move folders back and forth
+// between parents of their own, which must never write_lock the root, their common ancestor.
+// Last, threads fill folders with more children than Tree.c keeps in one map, so that
+// the folders get striped, and empty them again, so that they get unstriped.
+
+#include "Tree.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of threads, and of operations each of them does per policy.
+#define N_THREADS 8
+#define N_OPERATIONS 20000
+
+// Number of moves each thread does between its own two parents.
+#define N_MOVES 20000
+
+// Folder names are single letters from 'a' on, and random paths have up to MAX_DEPTH of them.
+// Moves make the tree deeper than that.
+#define N_NAMES 3
+#define MAX_DEPTH 3
+
+// Names of the children of a wide folder are two of the first N_WIDE_LETTERS letters, more
+// than a folder holds before it gets striped (STRIPE_THRESHOLD in Tree.c), and random paths
+// may go one folder deeper, with names like above. Each thread does N_WIDE_OPERATIONS per phase.
+#define N_WIDE_LETTERS 10
+#define N_WIDE_OPERATIONS 5000
+
+// Fail the test unless the condition holds.
+#define CHECK(condition) do { if (!(condition)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); exit(1); } } while (0)
+
+// A thread doing random operations on a tree.
+typedef struct Worker {
+    pthread_t thread;
+    Tree* tree;
+    unsigned seed;
+
+    // Numbers of folders that the worker's creates added and its removes took away.
+    size_t created, removed;
+
+    // Percentage of the operations on the wide folder that are creates, and its path,
+    // see `wide_work`.
+    int create_percent;
+    const char* wide;
+} Worker;
+
+// Write a random path of up to MAX_DEPTH folders to `path`.
+static void random_path(unsigned* seed, char* path)
+{
+    int depth = 1 + rand_r(seed) % MAX_DEPTH;
+    char* end = path;
+    *end++ = '/';
+    for (int i = 0; i < depth; i++) {
+        *end++ = 'a' + rand_r(seed) % N_NAMES;
+        *end++ = '/';
+    }
+    *end = '\0';
+}
+
+// Do N_OPERATIONS random operations and count the successful creates and removes.
+static void* work(void* arg)
+{
+    Worker* worker = arg;
+    char path[2 * MAX_DEPTH + 2], other[2 * MAX_DEPTH + 2];
+    for (int i = 0; i < N_OPERATIONS; i++) {
+        random_path(&worker->seed, path);
+        int result;
+        switch (rand_r(&worker->seed) % 4) {
+        case 0:
+            result = tree_create(worker->tree, path);
+            CHECK(result == SUCCESS || result == EEXIST || result == ENOENT);
+            if (result == SUCCESS) worker->created++;
+            break;
+        case 1:
+            result = tree_remove(worker->tree, path);
+            CHECK(result == SUCCESS || result == ENOENT || result == ENOTEMPTY);
+            if (result == SUCCESS) worker->removed++;
+            break;
+        case 2:
+            random_path(&worker->seed, other);
+            result = tree_move(worker->tree, path, other);
+            CHECK(result == SUCCESS || result == ENOENT || result == EEXIST || result == ESUCCESSOR);
+            break;
+        default:
+            free(tree_list(worker->tree, path));
+        }
+    }
+    return NULL;
+}
+
+// Write a random path of a child of the wide folder, or if `nested`, maybe of a child
+// of that, to `path`.
+static void random_wide_path(unsigned* seed, const char* wide, char* path, bool nested)
+{
+    char* end = stpcpy(path, wide);
+    *end++ = 'a' + rand_r(seed) % N_WIDE_LETTERS;
+    *end++ = 'a' + rand_r(seed) % N_WIDE_LETTERS;
+    *end++ = '/';
+    if (nested && rand_r(seed) % 4 == 0) {
+        *end++ = 'a' + rand_r(seed) % N_NAMES;
+        *end++ = '/';
+    }
+    *end = '\0';
+}
+
+// Do N_WIDE_OPERATIONS random operations in the wide folder, `create_percent` percent of them
+// creates and the rest up to 70 percent removes, and count the successful ones.
+static void* wide_work(void* arg)
+{
+    Worker* worker = arg;
+    char path[strlen(worker->wide) + 6], other[strlen(worker->wide) + 6];
+    for (int i = 0; i < N_WIDE_OPERATIONS; i++) {
+        random_wide_path(&worker->seed, worker->wide, path, true);
+        int operation = rand_r(&worker->seed) % 100, result;
+        if (operation < worker->create_percent) {
+            result = tree_create(worker->tree, path);
+            CHECK(result == SUCCESS || result == EEXIST || result == ENOENT);
+            if (result == SUCCESS) worker->created++;
+        } else if (operation < 70) {
+            result = tree_remove(worker->tree, path);
+            CHECK(result == SUCCESS || result == ENOENT || result == ENOTEMPTY);
+            if (result == SUCCESS) worker->removed++;
+        } else if (operation < 85) {
+            // Folders are only moved to the wide folder, so that it stays two folders deep.
+            random_wide_path(&worker->seed, worker->wide, other, false);
+            result = tree_move(worker->tree, path, other);
+            CHECK(result == SUCCESS || result == ENOENT || result == EEXIST || result == ESUCCESSOR);
+        } else {
+            free(tree_list(worker->tree, path));
+        }
+    }
+    return NULL;
+}
+
+// Return the number of folders below the root, found by listing them one by one.
+static size_t count_folders(Tree* tree)
+{
+    size_t n_paths = 1, capacity = 16, result = 0;
+    char** paths = malloc(capacity * sizeof(char*));
+    CHECK(paths);
+    paths[0] = strdup("/");
+    while (n_paths) {
+        char* path = paths[--n_paths];
+        char* list = tree_list(tree, path);
+        CHECK(list);
+        char* save = NULL;
+        for (char* name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+            if (n_paths == capacity) {
+                capacity *= 2;
+                paths = realloc(paths, capacity * sizeof(char*));
+                CHECK(paths);
+            }
+            char* child = malloc(strlen(path) + strlen(name) + 2);
+            CHECK(child);
+            sprintf(child, "%s%s/", path, name);
+            paths[n_paths++] = child;
+            result++;
+        }
+        free(list);
+        free(path);
+    }
+    free(paths);
+    return result;
+}
+
+// Remove all folders below the root, found by listing them, and return their number.
+static size_t remove_folders(Tree* tree)
+{
+    // Folders are listed in `paths` after their parents, and removed from the end.
+    size_t n_paths = 1, capacity = 16;
+    char** paths = malloc(capacity * sizeof(char*));
+    CHECK(paths);
+    paths[0] = strdup("/");
+    for (size_t i = 0; i < n_paths; i++) {
+        char* list = tree_list(tree, paths[i]);
+        CHECK(list);
+        char* save = NULL;
+        for (char* name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+            if (n_paths == capacity) {
+                capacity *= 2;
+                paths = realloc(paths, capacity * sizeof(char*));
+                CHECK(paths);
+            }
+            char* child = malloc(strlen(paths[i]) + strlen(name) + 2);
+            CHECK(child);
+            sprintf(child, "%s%s/", paths[i], name);
+            paths[n_paths++] = child;
+        }
+        free(list);
+    }
+    for (size_t i = n_paths; i-- > 1;) {
+        CHECK(tree_remove(tree, paths[i]) == SUCCESS);
+        free(paths[i]);
+    }
+    free(paths[0]);
+    free(paths);
+    return n_paths - 1;
+}
+
+// Run the workers on a new tree with the given policy and check the folders left.
+static void stress(TreeLockPolicy policy, const char* name)
+{
+    Tree* tree = tree_new_with_policy(policy);
+    Worker workers[N_THREADS];
+    for (int i = 0; i < N_THREADS; i++) {
+        workers[i] = (Worker) { .tree = tree, .seed = i + 1 };
+        CHECK(!pthread_create(&workers[i].thread, NULL, work, &workers[i]));
+    }
+    size_t created = 0, removed = 0;
+    for (int i = 0; i < N_THREADS; i++) {
+        CHECK(!pthread_join(workers[i].thread, NULL));
+        created += workers[i].created;
+        removed += workers[i].removed;
+    }
+
+    size_t n_folders = count_folders(tree);
+    CHECK(n_folders == created - removed);
+    CHECK(tree_stats(tree).n_folders == n_folders + 1);
+    printf("%s: %zu creates, %zu removes, %zu folders left\n", name, created, removed, n_folders);
+    tree_free(tree);
+}
+
+// A thread moving a folder between two children of the root that no other thread touches.
+typedef struct Mover {
+    pthread_t thread;
+    Tree* tree;
+    char from[8], to[8];
+} Mover;
+
+// Move the folder N_MOVES times, each time back to where it came from.
+static void* move_back_and_forth(void* arg)
+{
+    Mover* mover = arg;
+    for (int i = 0; i < N_MOVES; i++) {
+        if (i % 2 == 0) CHECK(tree_move(mover->tree, mover->from, mover->to) == SUCCESS);
+        else CHECK(tree_move(mover->tree, mover->to, mover->from) == SUCCESS);
+    }
+    return NULL;
+}
+
+// Run movers with disjoint parents on a new tree with the given policy and check that none
+// of their moves write_locked the root.
+static void disjoint_moves(TreeLockPolicy policy, const char* name)
+{
+    Tree* tree = tree_new_with_policy(policy);
+    Mover movers[N_THREADS];
+    for (int i = 0; i < N_THREADS; i++) {
+        movers[i].tree = tree;
+        char path[8];
+        sprintf(path, "/%c/", 'a' + i);
+        CHECK(tree_create(tree, path) == SUCCESS);
+        sprintf(path, "/%c/", 'a' + N_THREADS + i);
+        CHECK(tree_create(tree, path) == SUCCESS);
+        sprintf(movers[i].from, "/%c/f/", 'a' + i);
+        sprintf(movers[i].to, "/%c/f/", 'a' + N_THREADS + i);
+        CHECK(tree_create(tree, movers[i].from) == SUCCESS);
+    }
+
+    size_t root_write_locks = tree_stats(tree).root_write_locks;
+    for (int i = 0; i < N_THREADS; i++)
+        CHECK(!pthread_create(&movers[i].thread, NULL, move_back_and_forth, &movers[i]));
+    for (int i = 0; i < N_THREADS; i++)
+        CHECK(!pthread_join(movers[i].thread, NULL));
+
+    TreeStats stats = tree_stats(tree);
+    CHECK(stats.root_write_locks == root_write_locks);
+    CHECK(stats.n_folders == 3 * N_THREADS + 1);
+    printf("%s: %d moves between disjoint parents, none write_locked the root\n", name, N_THREADS * N_MOVES);
+    tree_free(tree);
+}
+
+// Run wide workers in the folder `wide` of the tree, `create_percent` percent of whose
+// operations are creates, and return the number of folders they added.
+static size_t wide_phase(Tree* tree, const char* wide, int create_percent)
+{
+    Worker workers[N_THREADS];
+    for (int i = 0; i < N_THREADS; i++) {
+        workers[i] = (Worker) { .tree = tree, .seed = create_percent * N_THREADS + i + 1, .create_percent = create_percent, .wide = wide };
+        CHECK(!pthread_create(&workers[i].thread, NULL, wide_work, &workers[i]));
+    }
+    size_t added = 0;
+    for (int i = 0; i < N_THREADS; i++) {
+        CHECK(!pthread_join(workers[i].thread, NULL));
+        added += workers[i].created - workers[i].removed;
+    }
+    return added;
+}
+
+// Fill the folder `wide` (the root or one of its children) of a new tree with the given
+// policy, so that it gets striped, and empty it again, so that it gets unstriped, checking
+// the folders left after each phase.
+static void wide_folders(TreeLockPolicy policy, const char* name, const char* wide)
+{
+    Tree* tree = tree_new_with_policy(policy);
+    size_t n_folders = 0;
+    if (strcmp(wide, "/")) {
+        CHECK(tree_create(tree, wide) == SUCCESS);
+        n_folders++;
+    }
+    n_folders += wide_phase(tree, wide, 55);
+    CHECK(count_folders(tree) == n_folders);
+    size_t n_striped = tree_stats(tree).n_striped;
+    CHECK(n_striped > 0);
+
+    n_folders += wide_phase(tree, wide, 10);
+    CHECK(count_folders(tree) == n_folders);
+
+    // Whatever is left is removed, every folder after its subfolders.
+    n_folders -= remove_folders(tree);
+    CHECK(n_folders == 0);
+    char* list = tree_list(tree, "/");
+    CHECK(list && !strcmp(list, ""));
+    free(list);
+    TreeStats stats = tree_stats(tree);
+    CHECK(stats.n_folders == 1 && stats.n_striped == 0);
+    printf("%s: %zu folders striped in %s, all unstriped once emptied\n", name, n_striped, wide);
+    tree_free(tree);
+}
+
+int main(void)
+{
+    stress(TREE_READER_PREFERENCE, "reader preference");
+    stress(TREE_WRITER_PREFERENCE, "writer preference");
+    stress(TREE_PHASE_FAIR, "phase fair");
+    disjoint_moves(TREE_READER_PREFERENCE, "reader preference");
+    disjoint_moves(TREE_WRITER_PREFERENCE, "writer preference");
+    disjoint_moves(TREE_PHASE_FAIR, "phase fair");
+    wide_folders(TREE_READER_PREFERENCE, "reader preference", "/");
+    wide_folders(TREE_WRITER_PREFERENCE, "writer preference", "/w/");
+    wide_folders(TREE_PHASE_FAIR, "phase fair", "/");
+    return 0;
+}